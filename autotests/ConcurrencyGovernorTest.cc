@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ConcurrencyGovernor.h"
+
+#include <QTest>
+
+#include <numeric>
+
+class ConcurrencyGovernorTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void splitThreads_data();
+    void splitThreads();
+    void splitThreadsTotal();
+};
+
+void ConcurrencyGovernorTest::splitThreads_data()
+{
+    QTest::addColumn<int>("threadCount");
+    QTest::addColumn<QVector<int>>("nodeCpuCounts");
+    QTest::addColumn<QVector<int>>("expected");
+
+    QTest::newRow("single node") << 6 << QVector<int>{ 12 } << QVector<int>{ 6 };
+    QTest::newRow("even split") << 8 << QVector<int>{ 4, 4 } << QVector<int>{ 4, 4 };
+    QTest::newRow("proportional") << 10 << QVector<int>{ 2, 6 } << QVector<int>{ 3, 7 };
+    QTest::newRow("remainders") << 5 << QVector<int>{ 3, 3, 3 } << QVector<int>{ 2, 2, 1 };
+    QTest::newRow("one thread per node") << 3 << QVector<int>{ 64, 1, 1 } << QVector<int>{ 1, 1, 1 };
+    QTest::newRow("small node") << 6 << QVector<int>{ 1, 15 } << QVector<int>{ 1, 5 };
+    QTest::newRow("unknown cpus") << 7 << QVector<int>{ 0, 0 } << QVector<int>{ 4, 3 };
+}
+
+void ConcurrencyGovernorTest::splitThreads()
+{
+    QFETCH(int, threadCount);
+    QFETCH(QVector<int>, nodeCpuCounts);
+    QFETCH(QVector<int>, expected);
+
+    QCOMPARE(ConcurrencyGovernor::splitThreads(threadCount, nodeCpuCounts), expected);
+}
+
+void ConcurrencyGovernorTest::splitThreadsTotal()
+{
+    const QVector<QVector<int>> topologies = {
+        { 1 },
+        { 4, 4 },
+        { 3, 5 },
+        { 1, 2, 3 },
+        { 7, 7, 7, 7 },
+        { 24, 1, 1, 1, 1, 2 },
+        { 0, 0, 0 },
+    };
+
+    for (const QVector<int> &nodeCpuCounts : topologies) {
+        for (int threadCount = nodeCpuCounts.count(); threadCount <= 64; ++threadCount) {
+            const QVector<int> threadCounts = ConcurrencyGovernor::splitThreads(threadCount, nodeCpuCounts);
+            QCOMPARE(threadCounts.count(), nodeCpuCounts.count());
+            QCOMPARE(std::accumulate(threadCounts.begin(), threadCounts.end(), 0), threadCount);
+            for (int nodeThreadCount : threadCounts)
+                QVERIFY(nodeThreadCount >= 1);
+        }
+    }
+}
+
+QTEST_GUILESS_MAIN(ConcurrencyGovernorTest)
+
+#include "ConcurrencyGovernorTest.moc"
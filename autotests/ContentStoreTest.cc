@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ContentStore.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <QTest>
+#include <QtConcurrent>
+
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class ContentStoreTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void key();
+    void insertAndRead();
+    void link();
+    void collectGarbage();
+    void collectGarbageWaitsForLock();
+};
+
+static QImage createImage(Qt::GlobalColor color)
+{
+    QImage image(16, 8, QImage::Format_RGB32);
+    image.fill(color);
+    return image;
+}
+
+static nlink_t linkCount(const QString &filePath)
+{
+    struct stat info;
+    if (::stat(QFile::encodeName(filePath).constData(), &info) != 0)
+        return 0;
+    return info.st_nlink;
+}
+
+static bool canLockExclusively(const ContentStore &store)
+{
+    const int fd = ::open(QFile::encodeName(store.path() + QLatin1String("/lock")).constData(), O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    const bool locked = ::flock(fd, LOCK_EX | LOCK_NB) == 0;
+    ::close(fd);
+
+    return locked;
+}
+
+void ContentStoreTest::key()
+{
+    const QImage image = createImage(Qt::red);
+    const QByteArray key = ContentStore::key(image, QStringLiteral("png"));
+
+    QVERIFY(key.endsWith(".png"));
+    QCOMPARE(ContentStore::key(image.copy(), QStringLiteral("png")), key);
+    QVERIFY(ContentStore::key(createImage(Qt::blue), QStringLiteral("png")) != key);
+    QVERIFY(ContentStore::key(image, QStringLiteral("jpg")) != ContentStore::key(image, QStringLiteral("jpg"), 50));
+    QCOMPARE(ContentStore::key(image, QStringLiteral("jpeg")), ContentStore::key(image, QStringLiteral("jpg")));
+    QCOMPARE(ContentStore::key(image, QStringLiteral("PNG")), key);
+
+    // Keys built in bands match keys of whole images.
+    ContentKeyBuilder builder(image.size(), image.format(), QStringLiteral("png"));
+    builder.addBand(image.copy(0, 0, image.width(), 3));
+    builder.addBand(image.copy(0, 3, image.width(), image.height() - 3));
+    QCOMPARE(builder.result(), key);
+}
+
+void ContentStoreTest::insertAndRead()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    ContentStore store(dir.filePath(QStringLiteral("store")));
+    const QByteArray key = ContentStore::key(createImage(Qt::red), QStringLiteral("png"));
+
+    QVERIFY(!store.contains(key));
+    QVERIFY(store.read(key).isNull());
+
+    QVERIFY(store.insert(key, QByteArrayLiteral("encoded")));
+    QVERIFY(store.contains(key));
+    QCOMPARE(store.read(key), QByteArrayLiteral("encoded"));
+}
+
+void ContentStoreTest::link()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    ContentStore store(dir.filePath(QStringLiteral("store")));
+    const QByteArray key = ContentStore::key(createImage(Qt::red), QStringLiteral("png"));
+    QVERIFY(store.insert(key, QByteArrayLiteral("encoded")));
+
+    const QString first = dir.filePath(QStringLiteral("first.png"));
+    const QString second = dir.filePath(QStringLiteral("second.png"));
+    QVERIFY(store.link(key, first));
+    QVERIFY(store.link(key, second));
+
+    QFile file(first);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), QByteArrayLiteral("encoded"));
+
+    // The store and both packages share the same file.
+    QCOMPARE(linkCount(first), nlink_t(3));
+
+    // Linking over an existing file replaces it.
+    const QByteArray otherKey = ContentStore::key(createImage(Qt::blue), QStringLiteral("png"));
+    QVERIFY(store.insert(otherKey, QByteArrayLiteral("other")));
+    QVERIFY(store.link(otherKey, second));
+    QCOMPARE(linkCount(first), nlink_t(2));
+    QCOMPARE(linkCount(second), nlink_t(2));
+}
+
+void ContentStoreTest::collectGarbage()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    ContentStore store(dir.filePath(QStringLiteral("store")));
+    const QByteArray linkedKey = ContentStore::key(createImage(Qt::red), QStringLiteral("png"));
+    const QByteArray unlinkedKey = ContentStore::key(createImage(Qt::blue), QStringLiteral("png"));
+    QVERIFY(store.insert(linkedKey, QByteArrayLiteral("linked")));
+    QVERIFY(store.insert(unlinkedKey, QByteArrayLiteral("unlinked")));
+
+    const QString filePath = dir.filePath(QStringLiteral("image.png"));
+    QVERIFY(store.link(linkedKey, filePath));
+
+    QCOMPARE(store.collectGarbage(), 1);
+    QVERIFY(store.contains(linkedKey));
+    QVERIFY(!store.contains(unlinkedKey));
+
+    // Once the package is gone, so is its object.
+    QVERIFY(QFile::remove(filePath));
+    QCOMPARE(store.collectGarbage(), 1);
+    QVERIFY(!store.contains(linkedKey));
+    QCOMPARE(store.collectGarbage(), 0);
+}
+
+void ContentStoreTest::collectGarbageWaitsForLock()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    ContentStore store(dir.filePath(QStringLiteral("store")));
+    std::unique_ptr<ContentStore::Lock> lock(new ContentStore::Lock(&store));
+
+    // An object that is inserted but not linked yet must survive while it's locked.
+    const QByteArray key = ContentStore::key(createImage(Qt::red), QStringLiteral("png"));
+    QVERIFY(store.insert(key, QByteArrayLiteral("encoded")));
+
+    // The collector takes an exclusive lock, which can't be granted while a lock is held.
+    QVERIFY(!canLockExclusively(store));
+
+    // Nothing is verified until the collector has finished, so it never outlives the store.
+    QFuture<int> removedCount = QtConcurrent::run([&store]() {
+        return store.collectGarbage();
+    });
+    const bool keptWhileLocked = store.contains(key);
+    const QString filePath = dir.filePath(QStringLiteral("image.png"));
+    const bool linked = store.link(key, filePath);
+    lock.reset();
+
+    QCOMPARE(removedCount.result(), 0);
+    QVERIFY(keptWhileLocked);
+    QVERIFY(linked);
+    QVERIFY(store.contains(key));
+    QVERIFY(canLockExclusively(store));
+}
+
+QTEST_GUILESS_MAIN(ContentStoreTest)
+
+#include "ContentStoreTest.moc"
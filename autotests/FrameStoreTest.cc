@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "BufferPool.h"
+#include "FrameStore.h"
+#include "MemoryBudget.h"
+
+#include <QTest>
+
+static const QSize frameSize(64, 64);
+// The frames are RGB32, so every frame takes 16 KiB, which is exactly a pool size class.
+static const qint64 frameBytes = 64 * 64 * 4;
+
+class FrameStoreTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void init();
+    void cleanup();
+
+    void adoptWithinBudget();
+    void spillAndUnspill();
+    void pinnedFramesStayResident();
+    void release();
+    void remove();
+
+private:
+    static QImage createFrame(int index);
+};
+
+QImage FrameStoreTest::createFrame(int index)
+{
+    QImage image(frameSize, QImage::Format_RGB32);
+    for (int y = 0; y < image.height(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x)
+            line[x] = qRgb(index * 40, x * 4, y * 4);
+    }
+    return image;
+}
+
+void FrameStoreTest::init()
+{
+    MemoryBudget::self()->setLimit(2 * frameBytes);
+}
+
+void FrameStoreTest::cleanup()
+{
+    BufferPool::self()->trim();
+    QCOMPARE(MemoryBudget::self()->usage(), qint64(0));
+    MemoryBudget::self()->setLimit(0);
+}
+
+void FrameStoreTest::adoptWithinBudget()
+{
+    FrameStore store(2);
+    store.adopt(0, createFrame(0));
+    store.adopt(1, createFrame(1));
+    QCOMPARE(MemoryBudget::self()->usage(), 2 * frameBytes);
+
+    for (int i = 0; i < store.count(); ++i) {
+        QCOMPARE(store.pin(i), createFrame(i));
+        store.unpin(i);
+    }
+}
+
+void FrameStoreTest::spillAndUnspill()
+{
+    MemoryBudget *budget = MemoryBudget::self();
+
+    FrameStore store(4);
+    for (int i = 0; i < store.count(); ++i) {
+        store.adopt(i, createFrame(i));
+        QVERIFY(budget->usage() <= budget->limit());
+    }
+
+    // Every frame is faulted back in, spilling the others to make room for it.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < store.count(); ++i) {
+            QCOMPARE(store.pin(i), createFrame(i));
+            QVERIFY(budget->usage() <= budget->limit());
+            store.unpin(i);
+        }
+    }
+
+    // Spilled frames are read back in bands as well.
+    for (int i = 0; i < store.count(); ++i) {
+        std::unique_ptr<BandReader> reader = store.openBands(i);
+        QVERIFY(reader);
+        QCOMPARE(reader->size(), frameSize);
+
+        const QImage expected = createFrame(i);
+        int y = 0;
+        for (QImage band = reader->readBand(); !band.isNull(); band = reader->readBand()) {
+            QCOMPARE(band, expected.copy(0, y, expected.width(), band.height()));
+            y += band.height();
+        }
+        QCOMPARE(y, expected.height());
+    }
+}
+
+void FrameStoreTest::pinnedFramesStayResident()
+{
+    FrameStore store(3);
+    for (int i = 0; i < store.count(); ++i)
+        store.adopt(i, createFrame(i));
+
+    const QImage &first = store.pin(0);
+    const QImage &second = store.pin(1);
+    QCOMPARE(first, createFrame(0));
+    QCOMPARE(second, createFrame(1));
+
+    // Nothing can be spilled and no other thread holds memory, so the pin fails
+    // rather than waiting forever.
+    QTest::ignoreMessage(QtWarningMsg, "Frame 2 does not fit in the memory budget");
+    QVERIFY(store.pin(2).isNull());
+
+    QCOMPARE(first, createFrame(0));
+    QCOMPARE(second, createFrame(1));
+
+    store.unpin(1);
+    QCOMPARE(store.pin(2), createFrame(2));
+    store.unpin(2);
+    store.unpin(0);
+}
+
+void FrameStoreTest::release()
+{
+    MemoryBudget *budget = MemoryBudget::self();
+
+    FrameStore store(2);
+    store.adopt(0, createFrame(0));
+    store.adopt(1, createFrame(1));
+
+    store.release(0);
+    QCOMPARE(budget->usage(), frameBytes);
+    QVERIFY(store.pin(0).isNull());
+
+    // A pinned frame is freed when the last pin goes away.
+    QCOMPARE(store.pin(1), createFrame(1));
+    store.release(1);
+    QCOMPARE(budget->usage(), frameBytes);
+    store.unpin(1);
+    QCOMPARE(budget->usage(), qint64(0));
+    QVERIFY(store.pin(1).isNull());
+}
+
+void FrameStoreTest::remove()
+{
+    MemoryBudget *budget = MemoryBudget::self();
+
+    FrameStore store(3);
+    for (int i = 0; i < store.count(); ++i)
+        store.adopt(i, createFrame(i));
+
+    store.remove(1);
+    QCOMPARE(store.count(), 2);
+    QVERIFY(budget->usage() <= budget->limit());
+
+    QCOMPARE(store.pin(0), createFrame(0));
+    store.unpin(0);
+    QCOMPARE(store.pin(1), createFrame(2));
+    store.unpin(1);
+}
+
+QTEST_GUILESS_MAIN(FrameStoreTest)
+
+#include "FrameStoreTest.moc"
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PackageArchive.h"
+
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+#include <QtEndian>
+
+class PackageArchiveTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void roundTrip();
+    void empty();
+    void malformed_data();
+    void malformed();
+
+private:
+    QByteArray pack(const QVector<QPair<QString, QByteArray>> &entries);
+    bool open(const QByteArray &contents);
+
+    QTemporaryDir m_dir;
+};
+
+template<typename T>
+static QByteArray patch(QByteArray contents, int offset, T value)
+{
+    const T littleEndianValue = qToLittleEndian(value);
+    contents.replace(offset, sizeof(T), reinterpret_cast<const char *>(&littleEndianValue), sizeof(T));
+    return contents;
+}
+
+static quint64 indexOffset(const QByteArray &contents)
+{
+    return qFromLittleEndian<quint64>(contents.constData() + contents.size() - 24);
+}
+
+QByteArray PackageArchiveTest::pack(const QVector<QPair<QString, QByteArray>> &entries)
+{
+    const QString fileName = m_dir.filePath(QStringLiteral("packed.dwpack"));
+
+    PackageArchiveWriter writer(fileName);
+    if (!writer.open())
+        return QByteArray();
+    for (const auto &entry : entries) {
+        if (!writer.add(entry.first, entry.second))
+            return QByteArray();
+    }
+    if (!writer.commit())
+        return QByteArray();
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    return file.readAll();
+}
+
+bool PackageArchiveTest::open(const QByteArray &contents)
+{
+    const QString fileName = m_dir.filePath(QStringLiteral("malformed.dwpack"));
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    if (file.write(contents) != contents.size())
+        return false;
+    file.close();
+
+    PackageArchive archive(fileName);
+    return archive.open();
+}
+
+void PackageArchiveTest::roundTrip()
+{
+    QVERIFY(m_dir.isValid());
+
+    const QString fileName = m_dir.filePath(QStringLiteral("package.dwpack"));
+    const QByteArray metaData = QByteArrayLiteral("<metadata/>");
+    const QByteArray image(5000, 'x');
+    const QByteArray preview;
+
+    PackageArchiveWriter writer(fileName);
+    QVERIFY(writer.open());
+    QVERIFY(writer.add(QStringLiteral("metadata.xml"), metaData));
+    QVERIFY(writer.add(QStringLiteral("images/1.png"), image));
+    QVERIFY(writer.add(QStringLiteral("preview.png"), preview));
+    QVERIFY(!QFile::exists(fileName));
+    QVERIFY(writer.commit());
+
+    PackageArchive archive(fileName);
+    QVERIFY(archive.open());
+    QCOMPARE(archive.entries(), QStringList({ QStringLiteral("metadata.xml"), QStringLiteral("images/1.png"), QStringLiteral("preview.png") }));
+    QVERIFY(archive.contains(QStringLiteral("images/1.png")));
+    QVERIFY(!archive.contains(QStringLiteral("images/2.png")));
+    QCOMPARE(archive.entry(QStringLiteral("metadata.xml")), metaData);
+    QCOMPARE(archive.entry(QStringLiteral("images/1.png")), image);
+    QVERIFY(archive.entry(QStringLiteral("preview.png")).isEmpty());
+    QVERIFY(archive.entry(QStringLiteral("images/2.png")).isNull());
+}
+
+void PackageArchiveTest::empty()
+{
+    QVERIFY(m_dir.isValid());
+
+    const QByteArray contents = pack({});
+    QVERIFY(!contents.isEmpty());
+    QVERIFY(open(contents));
+}
+
+void PackageArchiveTest::malformed_data()
+{
+    QVERIFY(m_dir.isValid());
+
+    QTest::addColumn<QByteArray>("contents");
+
+    const QByteArray contents = pack({
+        { QStringLiteral("a"), QByteArrayLiteral("hello") },
+        { QStringLiteral("b"), QByteArrayLiteral("world") },
+    });
+    QVERIFY(open(contents));
+
+    const quint64 index = indexOffset(contents);
+    const int footer = contents.size() - 24;
+    const quint64 firstOffset = qFromLittleEndian<quint64>(contents.constData() + index);
+
+    QTest::newRow("empty") << QByteArray();
+    QTest::newRow("truncated") << contents.left(contents.size() - 1);
+    QTest::newRow("trailing data") << contents + QByteArrayLiteral("junk");
+    QTest::newRow("bad magic") << patch<quint8>(contents, 0, 'X');
+    QTest::newRow("bad footer magic") << patch<quint8>(contents, footer + 16, 'X');
+    QTest::newRow("bad version") << patch<quint32>(contents, 8, 2);
+    QTest::newRow("page size too small") << patch<quint32>(contents, 12, 2048);
+    QTest::newRow("page size too large") << patch<quint32>(contents, 12, 2 * 1024 * 1024);
+    QTest::newRow("page size not a power of two") << patch<quint32>(contents, 12, 4096 + 512);
+    QTest::newRow("index inside header") << patch<quint64>(contents, footer, 8);
+    QTest::newRow("index past footer") << patch<quint64>(contents, footer, footer + 1);
+    QTest::newRow("too many entries") << patch<quint32>(contents, footer + 8, 1000000);
+    QTest::newRow("too few entries") << patch<quint32>(contents, footer + 8, 1);
+    QTest::newRow("entry inside header") << patch<quint64>(contents, index, 0);
+    QTest::newRow("misaligned entry") << patch<quint64>(contents, index, firstOffset + 1);
+    QTest::newRow("entry past index") << patch<quint64>(contents, index + 8, index - firstOffset + 1);
+    QTest::newRow("entry offset overflow") << patch<quint64>(contents, index, ~quint64(0) & ~quint64(0xfffff));
+    QTest::newRow("name past footer") << patch<quint32>(contents, index + 16, 1000);
+    QTest::newRow("duplicate name") << pack({
+        { QStringLiteral("a"), QByteArrayLiteral("hello") },
+        { QStringLiteral("a"), QByteArrayLiteral("world") },
+    });
+}
+
+void PackageArchiveTest::malformed()
+{
+    QFETCH(QByteArray, contents);
+    QVERIFY(!open(contents));
+}
+
+QTEST_GUILESS_MAIN(PackageArchiveTest)
+
+#include "PackageArchiveTest.moc"
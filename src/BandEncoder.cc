@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "BandEncoder.h"
+
+#include <QIODevice>
+
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+#include <png.h>
+
+// libpng and libjpeg report errors by longjmp()ing back into the caller, so functions
+// that call them must not have locals with non-trivial destructors.
+
+class PngBandEncoder : public BandEncoder
+{
+public:
+    PngBandEncoder(QIODevice *device, int quality);
+    ~PngBandEncoder() override;
+
+    bool begin(const QSize &size, bool hasAlphaChannel) override;
+    bool writeBand(const QImage &band) override;
+    bool finish() override;
+
+private:
+    static void write(png_structp png, png_bytep data, png_size_t size);
+    static void flush(png_structp png);
+    bool writeRows(const QImage &band);
+
+    QIODevice *m_device;
+    png_structp m_png = nullptr;
+    png_infop m_info = nullptr;
+    QImage::Format m_format = QImage::Format_RGB888;
+    int m_quality;
+    int m_rowsLeft = 0;
+    bool m_failed = false;
+};
+
+PngBandEncoder::PngBandEncoder(QIODevice *device, int quality)
+    : m_device(device)
+    , m_quality(quality)
+{
+}
+
+PngBandEncoder::~PngBandEncoder()
+{
+    if (m_png)
+        png_destroy_write_struct(&m_png, m_info ? &m_info : nullptr);
+}
+
+void PngBandEncoder::write(png_structp png, png_bytep data, png_size_t size)
+{
+    PngBandEncoder *encoder = static_cast<PngBandEncoder *>(png_get_io_ptr(png));
+    if (encoder->m_device->write(reinterpret_cast<const char *>(data), size) != qint64(size))
+        png_error(png, "Could not write encoded data");
+}
+
+void PngBandEncoder::flush(png_structp png)
+{
+    Q_UNUSED(png)
+}
+
+bool PngBandEncoder::begin(const QSize &size, bool hasAlphaChannel)
+{
+    m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!m_png)
+        return false;
+    m_info = png_create_info_struct(m_png);
+    if (!m_info)
+        return false;
+
+    m_format = hasAlphaChannel ? QImage::Format_RGBA8888 : QImage::Format_RGB888;
+    m_rowsLeft = size.height();
+
+    if (setjmp(png_jmpbuf(m_png))) {
+        m_failed = true;
+        return false;
+    }
+
+    png_set_write_fn(m_png, this, write, flush);
+    png_set_IHDR(m_png, m_info, size.width(), size.height(), 8,
+                 hasAlphaChannel ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (m_quality >= 0)
+        png_set_compression_level(m_png, (100 - qBound(0, m_quality, 100)) * 9 / 100);
+    png_write_info(m_png, m_info);
+
+    return true;
+}
+
+bool PngBandEncoder::writeBand(const QImage &band)
+{
+    if (m_failed || !m_png || band.height() > m_rowsLeft)
+        return false;
+    if (band.format() == m_format)
+        return writeRows(band);
+    return writeRows(band.convertToFormat(m_format));
+}
+
+bool PngBandEncoder::writeRows(const QImage &band)
+{
+    if (setjmp(png_jmpbuf(m_png))) {
+        m_failed = true;
+        return false;
+    }
+
+    for (int y = 0; y < band.height(); ++y)
+        png_write_row(m_png, const_cast<png_bytep>(band.constScanLine(y)));
+    m_rowsLeft -= band.height();
+
+    return true;
+}
+
+bool PngBandEncoder::finish()
+{
+    if (m_failed || !m_png || m_rowsLeft)
+        return false;
+
+    if (setjmp(png_jmpbuf(m_png))) {
+        m_failed = true;
+        return false;
+    }
+
+    png_write_end(m_png, m_info);
+
+    return true;
+}
+
+class JpegBandEncoder : public BandEncoder
+{
+public:
+    JpegBandEncoder(QIODevice *device, int quality);
+    ~JpegBandEncoder() override;
+
+    bool begin(const QSize &size, bool hasAlphaChannel) override;
+    bool writeBand(const QImage &band) override;
+    bool finish() override;
+
+private:
+    struct ErrorManager
+    {
+        jpeg_error_mgr manager;
+        jmp_buf jump;
+    };
+
+    struct Destination
+    {
+        jpeg_destination_mgr manager;
+        QIODevice *device;
+        JOCTET buffer[64 * 1024];
+    };
+
+    static void errorExit(j_common_ptr info);
+    static void outputMessage(j_common_ptr info);
+    static void initDestination(j_compress_ptr info);
+    static boolean emptyOutputBuffer(j_compress_ptr info);
+    static void termDestination(j_compress_ptr info);
+    bool writeRows(const QImage &band);
+
+    jpeg_compress_struct m_info;
+    ErrorManager m_errors;
+    std::unique_ptr<Destination> m_destination;
+    int m_quality;
+    int m_rowsLeft = 0;
+    bool m_created = false;
+    bool m_failed = false;
+};
+
+JpegBandEncoder::JpegBandEncoder(QIODevice *device, int quality)
+    : m_destination(new Destination)
+    , m_quality(quality)
+{
+    m_destination->device = device;
+}
+
+JpegBandEncoder::~JpegBandEncoder()
+{
+    if (m_created)
+        jpeg_destroy_compress(&m_info);
+}
+
+void JpegBandEncoder::errorExit(j_common_ptr info)
+{
+    ErrorManager *errors = reinterpret_cast<ErrorManager *>(info->err);
+    longjmp(errors->jump, 1);
+}
+
+void JpegBandEncoder::outputMessage(j_common_ptr info)
+{
+    Q_UNUSED(info)
+}
+
+void JpegBandEncoder::initDestination(j_compress_ptr info)
+{
+    Destination *destination = reinterpret_cast<Destination *>(info->dest);
+    destination->manager.next_output_byte = destination->buffer;
+    destination->manager.free_in_buffer = sizeof(destination->buffer);
+}
+
+boolean JpegBandEncoder::emptyOutputBuffer(j_compress_ptr info)
+{
+    Destination *destination = reinterpret_cast<Destination *>(info->dest);
+    const qint64 size = sizeof(destination->buffer);
+    if (destination->device->write(reinterpret_cast<const char *>(destination->buffer), size) != size)
+        errorExit(reinterpret_cast<j_common_ptr>(info));
+
+    destination->manager.next_output_byte = destination->buffer;
+    destination->manager.free_in_buffer = sizeof(destination->buffer);
+
+    return TRUE;
+}
+
+void JpegBandEncoder::termDestination(j_compress_ptr info)
+{
+    Destination *destination = reinterpret_cast<Destination *>(info->dest);
+    const qint64 size = sizeof(destination->buffer) - destination->manager.free_in_buffer;
+    if (destination->device->write(reinterpret_cast<const char *>(destination->buffer), size) != size)
+        errorExit(reinterpret_cast<j_common_ptr>(info));
+}
+
+bool JpegBandEncoder::begin(const QSize &size, bool hasAlphaChannel)
+{
+    Q_UNUSED(hasAlphaChannel)
+
+    m_info.err = jpeg_std_error(&m_errors.manager);
+    m_errors.manager.error_exit = errorExit;
+    m_errors.manager.output_message = outputMessage;
+
+    if (setjmp(m_errors.jump)) {
+        m_failed = true;
+        return false;
+    }
+
+    jpeg_create_compress(&m_info);
+    m_created = true;
+
+    m_destination->manager.init_destination = initDestination;
+    m_destination->manager.empty_output_buffer = emptyOutputBuffer;
+    m_destination->manager.term_destination = termDestination;
+    m_info.dest = &m_destination->manager;
+
+    m_info.image_width = size.width();
+    m_info.image_height = size.height();
+    m_info.input_components = 3;
+    m_info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&m_info);
+    jpeg_set_quality(&m_info, m_quality >= 0 ? qBound(0, m_quality, 100) : 75, TRUE);
+    jpeg_start_compress(&m_info, TRUE);
+
+    m_rowsLeft = size.height();
+
+    return true;
+}
+
+bool JpegBandEncoder::writeBand(const QImage &band)
+{
+    if (m_failed || !m_created || band.height() > m_rowsLeft)
+        return false;
+    if (band.format() == QImage::Format_RGB888)
+        return writeRows(band);
+    return writeRows(band.convertToFormat(QImage::Format_RGB888));
+}
+
+bool JpegBandEncoder::writeRows(const QImage &band)
+{
+    if (setjmp(m_errors.jump)) {
+        m_failed = true;
+        return false;
+    }
+
+    for (int y = 0; y < band.height(); ++y) {
+        JSAMPROW row = const_cast<JSAMPROW>(band.constScanLine(y));
+        jpeg_write_scanlines(&m_info, &row, 1);
+    }
+    m_rowsLeft -= band.height();
+
+    return true;
+}
+
+bool JpegBandEncoder::finish()
+{
+    if (m_failed || !m_created || m_rowsLeft)
+        return false;
+
+    if (setjmp(m_errors.jump)) {
+        m_failed = true;
+        return false;
+    }
+
+    jpeg_finish_compress(&m_info);
+
+    return true;
+}
+
+BandEncoder::~BandEncoder()
+{
+}
+
+bool BandEncoder::supportsFormat(const QString &format)
+{
+    const QString lowerCaseFormat = format.toLower();
+    return lowerCaseFormat == QLatin1String("png")
+        || lowerCaseFormat == QLatin1String("jpg")
+        || lowerCaseFormat == QLatin1String("jpeg");
+}
+
+std::unique_ptr<BandEncoder> BandEncoder::create(const QString &format, QIODevice *device, int quality)
+{
+    const QString lowerCaseFormat = format.toLower();
+    if (lowerCaseFormat == QLatin1String("png"))
+        return std::make_unique<PngBandEncoder>(device, quality);
+    if (lowerCaseFormat == QLatin1String("jpg") || lowerCaseFormat == QLatin1String("jpeg"))
+        return std::make_unique<JpegBandEncoder>(device, quality);
+    return nullptr;
+}
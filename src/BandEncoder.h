@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+#include <memory>
+
+class QIODevice;
+
+/**
+ * The BandEncoder class encodes an image that is fed in horizontal bands of rows, so
+ * the encoder never needs the whole image in memory. Rows are streamed straight into
+ * libpng or libjpeg.
+ */
+class Q_DECL_EXPORT BandEncoder
+{
+public:
+    virtual ~BandEncoder();
+
+    /**
+     * Returns @c true if images can be encoded in bands in the given @p format.
+     */
+    static bool supportsFormat(const QString &format);
+
+    /**
+     * Creates an encoder that writes images in the given @p format to the @p device.
+     * The @p quality ranges from 0 to 100, -1 picks the default of the format.
+     *
+     * This method will return @c null if the format is not supported.
+     */
+    static std::unique_ptr<BandEncoder> create(const QString &format, QIODevice *device, int quality = -1);
+
+    /**
+     * Starts encoding an image with the given @p size.
+     */
+    virtual bool begin(const QSize &size, bool hasAlphaChannel) = 0;
+
+    /**
+     * Encodes the next @p band of rows. The band is converted to the pixel format of the
+     * encoder if needed.
+     */
+    virtual bool writeBand(const QImage &band) = 0;
+
+    /**
+     * Finishes encoding the image. Returns @c false if not all rows have been written
+     * or an error has occurred.
+     */
+    virtual bool finish() = 0;
+};
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "BandReader.h"
+
+#include <algorithm>
+
+BandReader::~BandReader()
+{
+}
+
+int BandReader::bandHeight(int bytesPerLine)
+{
+    static const int bandSize = 2 << 20;
+    return std::max(1, bandSize / std::max(1, bytesPerLine));
+}
+
+ImageBandReader::ImageBandReader(const QImage &image, std::function<void()> finished)
+    : m_image(image)
+    , m_finished(finished)
+    , m_bandHeight(bandHeight(image.bytesPerLine()))
+{
+}
+
+ImageBandReader::~ImageBandReader()
+{
+    // Drop the reference to the image before letting the owner know it's free to go.
+    m_image = QImage();
+    if (m_finished)
+        m_finished();
+}
+
+QSize ImageBandReader::size() const
+{
+    return m_image.size();
+}
+
+QImage::Format ImageBandReader::format() const
+{
+    return m_image.format();
+}
+
+QImage ImageBandReader::readBand()
+{
+    if (m_y >= m_image.height())
+        return QImage();
+
+    const int rows = std::min(m_bandHeight, m_image.height() - m_y);
+    QImage band(m_image.constScanLine(m_y), m_image.width(), rows, m_image.bytesPerLine(), m_image.format());
+    if (m_image.colorCount())
+        band.setColorTable(m_image.colorTable());
+    m_y += rows;
+
+    return band;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QImage>
+#include <QSize>
+
+#include <functional>
+
+/**
+ * The BandReader class provides the pixel data of a frame as a sequence of horizontal
+ * bands, from top to bottom, so a frame can be processed without ever holding all of
+ * it in memory.
+ */
+class Q_DECL_EXPORT BandReader
+{
+public:
+    virtual ~BandReader();
+
+    /**
+     * Returns the size of the whole frame.
+     */
+    virtual QSize size() const = 0;
+
+    /**
+     * Returns the pixel format of the bands.
+     */
+    virtual QImage::Format format() const = 0;
+
+    /**
+     * Returns the next band of rows. The band is valid until the next call or until the
+     * reader is destroyed, whichever comes first.
+     *
+     * This method will return a null image after the last band or if an error occurs.
+     */
+    virtual QImage readBand() = 0;
+
+    /**
+     * Returns the number of rows that makes a band of rows of the given @p bytesPerLine
+     * take a couple of megabytes.
+     */
+    static int bandHeight(int bytesPerLine);
+};
+
+/**
+ * The ImageBandReader class reads bands of an image that is already in memory. Bands
+ * refer to the image, so no pixel data is copied.
+ */
+class Q_DECL_EXPORT ImageBandReader : public BandReader
+{
+public:
+    /**
+     * Constructs a band reader for the given @p image. The @p finished function, if any,
+     * is called when the reader is destroyed.
+     */
+    explicit ImageBandReader(const QImage &image, std::function<void()> finished = nullptr);
+    ~ImageBandReader() override;
+
+    QSize size() const override;
+    QImage::Format format() const override;
+    QImage readBand() override;
+
+private:
+    QImage m_image;
+    std::function<void()> m_finished;
+    int m_bandHeight;
+    int m_y = 0;
+};
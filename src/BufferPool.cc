@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "BufferPool.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+// Buffers are aligned to cache lines, the header lives right before the buffer.
+static const qint64 s_headerSize = 64;
+
+// Every power of two is split into this many size classes, so at most 1/8 of a buffer
+// is wasted.
+static const int s_sizeClassSteps = 8;
+
+static const qint64 s_minimumScratchCapacity = 64 * 1024;
+
+static void cleanupPooledImage(void *data)
+{
+    BufferPool::deallocate(static_cast<uchar *>(data));
+}
+
+BufferPool::BufferPool(MemoryBudget *budget)
+    : m_maximumIdleSize(qint64(512) * 1024 * 1024)
+    , m_budget(budget)
+{
+    m_budget->addReclaimer(this, true);
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+    m_budget->removeReclaimer(this);
+}
+
+BufferPool *BufferPool::self()
+{
+    static BufferPool pool;
+    return &pool;
+}
+
+int BufferPool::sizeClassFor(qint64 size)
+{
+    const int exponent = 63 - __builtin_clzll(quint64(std::max<qint64>(size, s_sizeClassSteps)));
+    int sizeClass = exponent * s_sizeClassSteps;
+    while (sizeClassCapacity(sizeClass) < size)
+        ++sizeClass;
+    return sizeClass;
+}
+
+qint64 BufferPool::sizeClassCapacity(int sizeClass)
+{
+    const int exponent = sizeClass / s_sizeClassSteps;
+    const int step = sizeClass % s_sizeClassSteps;
+    return (qint64(s_sizeClassSteps + step) << exponent) / s_sizeClassSteps;
+}
+
+uchar *BufferPool::allocate(qint64 size)
+{
+    const int sizeClass = sizeClassFor(size);
+    const qint64 blockSize = sizeClassCapacity(sizeClass);
+
+    QMutexLocker locker(&m_mutex);
+
+    uchar *block = nullptr;
+
+    // Idle buffers are charged already.
+    auto it = m_freeLists.find(sizeClass);
+    if (it != m_freeLists.end() && !it->isEmpty()) {
+        block = it->takeLast();
+        m_statistics.bytesIdle -= blockSize;
+        ++m_statistics.hits;
+    } else {
+        // The budget may ask the pool to free idle buffers, so it's not locked meanwhile.
+        locker.unlock();
+        if (!m_budget->acquire(blockSize))
+            return nullptr;
+
+        void *memory = nullptr;
+        if (posix_memalign(&memory, s_headerSize, s_headerSize + blockSize) != 0) {
+            m_budget->release(blockSize);
+            return nullptr;
+        }
+        block = static_cast<uchar *>(memory);
+
+        locker.relock();
+        ++m_statistics.misses;
+    }
+
+    m_statistics.bytesInUse += blockSize;
+    m_statistics.peakBytes = std::max(m_statistics.peakBytes, m_statistics.bytesInUse + m_statistics.bytesIdle);
+
+    Header *header = reinterpret_cast<Header *>(block);
+    header->pool = this;
+    header->sizeClass = sizeClass;
+
+    return block + s_headerSize;
+}
+
+void BufferPool::deallocate(uchar *data)
+{
+    if (!data)
+        return;
+
+    uchar *block = data - s_headerSize;
+    const Header *header = reinterpret_cast<const Header *>(block);
+    header->pool->recycle(block, header->sizeClass);
+}
+
+qint64 BufferPool::capacity(const uchar *data)
+{
+    const Header *header = reinterpret_cast<const Header *>(data - s_headerSize);
+    return sizeClassCapacity(header->sizeClass);
+}
+
+void BufferPool::recycle(uchar *block, int sizeClass)
+{
+    const qint64 blockSize = sizeClassCapacity(sizeClass);
+
+    QMutexLocker locker(&m_mutex);
+    m_statistics.bytesInUse -= blockSize;
+
+    if (m_statistics.bytesIdle + blockSize > m_maximumIdleSize) {
+        std::free(block);
+        m_budget->release(blockSize);
+        return;
+    }
+
+    m_freeLists[sizeClass].append(block);
+    m_statistics.bytesIdle += blockSize;
+}
+
+QImage BufferPool::createImage(const QSize &size, QImage::Format format)
+{
+    const int depth = QImage::toPixelFormat(format).bitsPerPixel();
+    const int bytesPerLine = ((size.width() * depth + 31) / 32) * 4;
+
+    uchar *data = allocate(qint64(bytesPerLine) * size.height());
+    if (!data)
+        return QImage();
+
+    return QImage(data, size.width(), size.height(), bytesPerLine, format, cleanupPooledImage, data);
+}
+
+void BufferPool::setMaximumIdleSize(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maximumIdleSize = bytes;
+}
+
+qint64 BufferPool::maximumIdleSize() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_maximumIdleSize;
+}
+
+void BufferPool::trim()
+{
+    reclaim(std::numeric_limits<qint64>::max());
+}
+
+BufferPool::Statistics BufferPool::statistics() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_statistics;
+}
+
+qint64 BufferPool::reclaim(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+
+    qint64 reclaimed = 0;
+
+    // Free the largest buffers first, they are the least likely to be reused exactly.
+    QList<int> sizeClasses = m_freeLists.keys();
+    std::sort(sizeClasses.begin(), sizeClasses.end(), std::greater<int>());
+
+    for (int sizeClass : qAsConst(sizeClasses)) {
+        QVector<uchar *> &freeList = m_freeLists[sizeClass];
+        const qint64 blockSize = sizeClassCapacity(sizeClass);
+        while (!freeList.isEmpty() && reclaimed < bytes) {
+            std::free(freeList.takeLast());
+            m_statistics.bytesIdle -= blockSize;
+            m_budget->release(blockSize);
+            reclaimed += blockSize;
+        }
+        if (reclaimed >= bytes)
+            break;
+    }
+
+    return reclaimed;
+}
+
+ScratchBuffer::ScratchBuffer(BufferPool *pool)
+    : m_pool(pool)
+{
+}
+
+ScratchBuffer::~ScratchBuffer()
+{
+    BufferPool::deallocate(m_data);
+}
+
+QByteArray ScratchBuffer::data() const
+{
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(m_data), m_size);
+}
+
+qint64 ScratchBuffer::size() const
+{
+    return m_size;
+}
+
+bool ScratchBuffer::reserve(qint64 capacity)
+{
+    if (capacity <= m_capacity)
+        return true;
+
+    const qint64 newCapacity = std::max({ capacity, 2 * m_capacity, s_minimumScratchCapacity });
+    uchar *data = m_pool->allocate(newCapacity);
+    if (!data)
+        return false;
+
+    if (m_data) {
+        std::memcpy(data, m_data, m_size);
+        BufferPool::deallocate(m_data);
+    }
+
+    m_data = data;
+    m_capacity = BufferPool::capacity(data);
+
+    return true;
+}
+
+qint64 ScratchBuffer::readData(char *data, qint64 maxSize)
+{
+    const qint64 size = std::min(maxSize, m_size - pos());
+    if (size <= 0)
+        return 0;
+    std::memcpy(data, m_data + pos(), size);
+    return size;
+}
+
+qint64 ScratchBuffer::writeData(const char *data, qint64 size)
+{
+    const qint64 offset = pos();
+    if (!reserve(offset + size))
+        return -1;
+
+    std::memcpy(m_data + offset, data, size);
+    m_size = std::max(m_size, offset + size);
+
+    return size;
+}
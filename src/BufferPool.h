@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "MemoryBudget.h"
+
+#include <QHash>
+#include <QIODevice>
+#include <QImage>
+#include <QMutex>
+#include <QVector>
+
+/**
+ * The BufferPool class recycles large scratch buffers, e.g. pixel data of frames and
+ * previews, and encoder output.
+ *
+ * Buffers are grouped in size classes, eight per power of two. Returned buffers are
+ * kept for reuse, so steady-state batch imports don't keep asking the kernel for fresh
+ * zeroed pages. Buffers are charged to the memory budget from the moment they are
+ * allocated until they are freed, whether they are in use or idle. Idle buffers are
+ * the first thing to be freed when the budget runs out of memory.
+ */
+class Q_DECL_EXPORT BufferPool : public MemoryBudget::Reclaimer
+{
+public:
+    struct Statistics
+    {
+        // The number of allocations that have been served with a recycled buffer.
+        qint64 hits = 0;
+
+        // The number of allocations that needed a fresh buffer.
+        qint64 misses = 0;
+
+        // The amount of memory handed out and not returned yet, in bytes.
+        qint64 bytesInUse = 0;
+
+        // The amount of memory kept for reuse, in bytes.
+        qint64 bytesIdle = 0;
+
+        // The largest amount of memory that has been owned by the pool, in bytes.
+        qint64 peakBytes = 0;
+    };
+
+    explicit BufferPool(MemoryBudget *budget = MemoryBudget::self());
+    ~BufferPool() override;
+
+    static BufferPool *self();
+
+    /**
+     * Returns a buffer that can hold at least @p size bytes, or @c null if the memory
+     * could not be allocated or doesn't fit in the memory budget. The contents of the
+     * buffer are undefined. The capacity of the buffer stays charged to the budget
+     * until the pool frees it, so callers must not charge it themselves.
+     */
+    uchar *allocate(qint64 size);
+
+    /**
+     * Returns the given buffer to the pool it has been allocated from.
+     */
+    static void deallocate(uchar *data);
+
+    /**
+     * Returns the number of bytes the given buffer can hold.
+     */
+    static qint64 capacity(const uchar *data);
+
+    /**
+     * Returns an image whose pixel data is allocated from the pool. The pixel data is
+     * returned to the pool when the image is destroyed.
+     */
+    QImage createImage(const QSize &size, QImage::Format format);
+
+    /**
+     * Sets the maximum amount of idle memory that the pool may keep, in bytes.
+     */
+    void setMaximumIdleSize(qint64 bytes);
+    qint64 maximumIdleSize() const;
+
+    /**
+     * Frees all idle buffers.
+     */
+    void trim();
+
+    Statistics statistics() const;
+
+    qint64 reclaim(qint64 bytes) override;
+
+private:
+    struct Header
+    {
+        BufferPool *pool;
+        int sizeClass;
+    };
+
+    static int sizeClassFor(qint64 size);
+    static qint64 sizeClassCapacity(int sizeClass);
+    void recycle(uchar *block, int sizeClass);
+
+    QHash<int, QVector<uchar *>> m_freeLists;
+    Statistics m_statistics;
+    qint64 m_maximumIdleSize;
+    mutable QMutex m_mutex;
+    MemoryBudget *m_budget;
+
+    Q_DISABLE_COPY(BufferPool)
+};
+
+/**
+ * The ScratchBuffer class is an in-memory I/O device, similar to QBuffer, whose storage
+ * is allocated from a buffer pool.
+ */
+class Q_DECL_EXPORT ScratchBuffer : public QIODevice
+{
+public:
+    explicit ScratchBuffer(BufferPool *pool = BufferPool::self());
+    ~ScratchBuffer() override;
+
+    /**
+     * Returns the contents of the buffer without copying them. The returned byte array
+     * is valid as long as the buffer is alive and not written to.
+     */
+    QByteArray data() const;
+
+    qint64 size() const override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 size) override;
+
+private:
+    bool reserve(qint64 capacity);
+
+    BufferPool *m_pool;
+    uchar *m_data = nullptr;
+    qint64 m_capacity = 0;
+    qint64 m_size = 0;
+};
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ConcurrencyGovernor.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFutureSynchronizer>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+static QByteArray readFile(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return file.readAll();
+}
+
+static QVector<int> parseCpuList(const QByteArray &text)
+{
+    QVector<int> cpus;
+
+    const QList<QByteArray> ranges = text.trimmed().split(',');
+    for (const QByteArray &range : ranges) {
+        if (range.isEmpty())
+            continue;
+        const int separator = range.indexOf('-');
+        if (separator == -1) {
+            cpus << range.toInt();
+            continue;
+        }
+        const int first = range.left(separator).toInt();
+        const int last = range.mid(separator + 1).toInt();
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus << cpu;
+    }
+
+    return cpus;
+}
+
+static QVector<int> allowedCpus()
+{
+    QVector<int> cpus;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set))
+            cpus << cpu;
+    }
+
+    return cpus;
+}
+
+static QString cgroupPath()
+{
+    const QList<QByteArray> lines = readFile(QStringLiteral("/proc/self/cgroup")).split('\n');
+    for (const QByteArray &line : lines) {
+        if (line.startsWith("0::"))
+            return QStringLiteral("/sys/fs/cgroup") + QString::fromUtf8(line.mid(3));
+    }
+    return QString();
+}
+
+static void readCgroupLimits(qreal *cpuLimit, qint64 *memoryLimit)
+{
+    *cpuLimit = 0;
+    *memoryLimit = 0;
+
+    QString path = cgroupPath();
+    if (path.isEmpty())
+        return;
+
+    // Limits are hierarchical, so the effective limit is the tightest one on the way
+    // to the root of the hierarchy.
+    const QString rootPath = QStringLiteral("/sys/fs/cgroup");
+    forever {
+        const QList<QByteArray> cpuMax = readFile(path + QLatin1String("/cpu.max")).simplified().split(' ');
+        if (cpuMax.count() == 2 && cpuMax.at(0) != "max") {
+            const qreal quota = cpuMax.at(0).toDouble() / cpuMax.at(1).toDouble();
+            if (quota > 0 && (!*cpuLimit || quota < *cpuLimit))
+                *cpuLimit = quota;
+        }
+
+        const QByteArray memoryMax = readFile(path + QLatin1String("/memory.max")).trimmed();
+        if (!memoryMax.isEmpty() && memoryMax != "max") {
+            bool ok = false;
+            const qint64 limit = memoryMax.toLongLong(&ok);
+            if (ok && limit > 0 && (!*memoryLimit || limit < *memoryLimit))
+                *memoryLimit = limit;
+        }
+
+        if (path.length() <= rootPath.length())
+            break;
+        path = path.left(path.lastIndexOf(QLatin1Char('/')));
+    }
+}
+
+static QVector<QVector<int>> discoverNodes(const QVector<int> &allowed)
+{
+    QVector<QVector<int>> nodes;
+
+    const QDir nodesDir(QStringLiteral("/sys/devices/system/node"));
+    const QStringList entries = nodesDir.entryList({ QStringLiteral("node*") }, QDir::Dirs, QDir::Name);
+    for (const QString &entry : entries) {
+        const QVector<int> nodeCpus = parseCpuList(readFile(nodesDir.filePath(entry + QLatin1String("/cpulist"))));
+
+        QVector<int> cpus;
+        for (int cpu : nodeCpus) {
+            if (allowed.contains(cpu))
+                cpus << cpu;
+        }
+        if (!cpus.isEmpty())
+            nodes << cpus;
+    }
+
+    if (nodes.isEmpty())
+        nodes << allowed;
+
+    return nodes;
+}
+
+static void bindCurrentThread(int node, const QVector<int> &cpus)
+{
+    // Worker threads of a node never serve other nodes, so binding them once is enough.
+    thread_local int boundNode = -1;
+    if (boundNode == node)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+        boundNode = node;
+}
+
+ConcurrencyGovernor::ConcurrencyGovernor()
+{
+    const QVector<int> cpus = allowedCpus();
+
+    qreal cpuLimit = 0;
+    readCgroupLimits(&cpuLimit, &m_memoryLimit);
+
+    m_threadCount = cpus.isEmpty() ? QThread::idealThreadCount() : cpus.count();
+    if (cpuLimit > 0)
+        m_threadCount = std::min(m_threadCount, int(std::ceil(cpuLimit)));
+    m_threadCount = std::max(m_threadCount, 1);
+
+    QVector<QVector<int>> nodes = discoverNodes(cpus);
+
+    // Don't spread fewer threads than nodes, prefer the nodes with the most CPUs.
+    std::stable_sort(nodes.begin(), nodes.end(), [](const QVector<int> &a, const QVector<int> &b) {
+        return a.count() > b.count();
+    });
+    nodes.resize(std::min(nodes.count(), m_threadCount));
+
+    QVector<int> nodeCpuCounts;
+    for (const QVector<int> &node : qAsConst(nodes))
+        nodeCpuCounts.append(node.count());
+    const QVector<int> threadCounts = splitThreads(m_threadCount, nodeCpuCounts);
+
+    for (int i = 0; i < nodes.count(); ++i) {
+        Node *node = new Node;
+        node->cpus = nodes.at(i);
+        node->threadPool.reset(new QThreadPool);
+        node->threadPool->setMaxThreadCount(threadCounts.at(i));
+
+        m_nodes << node;
+    }
+}
+
+QVector<int> ConcurrencyGovernor::splitThreads(int threadCount, const QVector<int> &nodeCpuCounts)
+{
+    const int nodeCount = nodeCpuCounts.count();
+
+    // Nodes are weighted equally if their CPUs are not known.
+    QVector<int> weights = nodeCpuCounts;
+    int totalWeight = std::accumulate(weights.begin(), weights.end(), 0);
+    if (!totalWeight) {
+        weights.fill(1);
+        totalWeight = nodeCount;
+    }
+
+    // Every node gets a thread and the rest is split in proportion to the weights. The
+    // shares are rounded down and the threads that are left over go to the nodes with
+    // the largest remainders, so the total is never exceeded.
+    const int spareCount = std::max(threadCount - nodeCount, 0);
+    QVector<int> threadCounts(nodeCount, 1);
+    QVector<qint64> remainders(nodeCount);
+    int leftOverCount = spareCount;
+    for (int i = 0; i < nodeCount; ++i) {
+        const qint64 share = qint64(spareCount) * weights.at(i);
+        threadCounts[i] += int(share / totalWeight);
+        remainders[i] = share % totalWeight;
+        leftOverCount -= int(share / totalWeight);
+    }
+
+    QVector<int> order(nodeCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&remainders](int a, int b) {
+        return remainders.at(a) > remainders.at(b);
+    });
+    for (int i = 0; i < leftOverCount; ++i)
+        ++threadCounts[order.at(i)];
+
+    return threadCounts;
+}
+
+ConcurrencyGovernor::~ConcurrencyGovernor()
+{
+    for (Node *node : qAsConst(m_nodes))
+        node->threadPool->waitForDone();
+    qDeleteAll(m_nodes);
+}
+
+ConcurrencyGovernor *ConcurrencyGovernor::self()
+{
+    static ConcurrencyGovernor governor;
+    return &governor;
+}
+
+int ConcurrencyGovernor::threadCount() const
+{
+    return m_threadCount;
+}
+
+int ConcurrencyGovernor::nodeCount() const
+{
+    return m_nodes.count();
+}
+
+qint64 ConcurrencyGovernor::memoryLimit() const
+{
+    return m_memoryLimit;
+}
+
+int ConcurrencyGovernor::nodeForFrame(int index) const
+{
+    return index % m_nodes.count();
+}
+
+void ConcurrencyGovernor::map(int count, const std::function<void(int)> &function)
+{
+    map(count, 1, [&function](int index, int) {
+        function(index);
+    });
+}
+
+void ConcurrencyGovernor::map(int count, int taskCount, const std::function<void(int, int)> &function)
+{
+    const bool bindThreads = m_nodes.count() > 1;
+
+    QFutureSynchronizer<void> synchronizer;
+    for (int i = 0; i < count; ++i) {
+        const int nodeIndex = nodeForFrame(i);
+        const Node *node = m_nodes.at(nodeIndex);
+        for (int task = 0; task < taskCount; ++task) {
+            synchronizer.addFuture(QtConcurrent::run(node->threadPool.get(), [&function, i, task, nodeIndex, node, bindThreads]() {
+                if (bindThreads)
+                    bindCurrentThread(nodeIndex, node->cpus);
+                function(i, task);
+            }));
+        }
+    }
+    synchronizer.waitForFinished();
+}
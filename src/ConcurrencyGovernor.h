@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QVector>
+
+#include <functional>
+#include <memory>
+
+class QThreadPool;
+
+/**
+ * The ConcurrencyGovernor class sizes and schedules every parallel stage of the import
+ * pipeline, i.e. decoding, encoding and writing.
+ *
+ * The number of worker threads is derived from the CPU affinity mask of the process and
+ * the cgroup v2 CPU quota, rather than from the number of CPUs in the machine. On NUMA
+ * machines, there is a thread pool per node, and the decode and the encode of a frame
+ * run on the same node, so the pixel data of the frame stays in local memory.
+ */
+class Q_DECL_EXPORT ConcurrencyGovernor
+{
+public:
+    ConcurrencyGovernor();
+    ~ConcurrencyGovernor();
+
+    static ConcurrencyGovernor *self();
+
+    /**
+     * Returns the total number of worker threads.
+     */
+    int threadCount() const;
+
+    /**
+     * Returns the number of NUMA nodes that worker threads are spread across.
+     */
+    int nodeCount() const;
+
+    /**
+     * Returns the cgroup v2 memory limit of the process, in bytes, or 0 if there is none.
+     */
+    qint64 memoryLimit() const;
+
+    /**
+     * Returns the NUMA node that processes the frame with the given @p index.
+     */
+    int nodeForFrame(int index) const;
+
+    /**
+     * Calls @p function for every frame index in [0, @p count), each on the node that
+     * the frame belongs to, and blocks until all calls have returned.
+     */
+    void map(int count, const std::function<void(int)> &function);
+
+    /**
+     * Calls @p function for every frame index in [0, @p count) and every task index in
+     * [0, @p taskCount), each on the node that the frame belongs to, and blocks until
+     * all calls have returned.
+     */
+    void map(int count, int taskCount, const std::function<void(int, int)> &function);
+
+    /**
+     * Splits @p threadCount worker threads across NUMA nodes in proportion to the given
+     * numbers of CPUs of the nodes. Every node gets at least one thread and the shares
+     * add up to @p threadCount, which must not be less than the number of nodes.
+     */
+    static QVector<int> splitThreads(int threadCount, const QVector<int> &nodeCpuCounts);
+
+private:
+    struct Node
+    {
+        QVector<int> cpus;
+        std::unique_ptr<QThreadPool> threadPool;
+    };
+
+    QVector<Node *> m_nodes;
+    qint64 m_memoryLimit = 0;
+    int m_threadCount = 1;
+
+    Q_DISABLE_COPY(ConcurrencyGovernor)
+};
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ContentStore.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QFile>
+#include <QSaveFile>
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ContentStore::ContentStore(const QString &path)
+    : m_path(path)
+{
+}
+
+ContentStore::Lock::Lock(const ContentStore *store)
+    : m_fd(store->lock(LOCK_SH))
+{
+}
+
+ContentStore::Lock::~Lock()
+{
+    unlock(m_fd);
+}
+
+int ContentStore::lock(int operation) const
+{
+    QDir().mkpath(m_path);
+
+    const int fd = ::open(QFile::encodeName(m_path + QLatin1String("/lock")).constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    while (::flock(fd, operation) == -1) {
+        if (errno != EINTR) {
+            ::close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+void ContentStore::unlock(int fd)
+{
+    // Closing the file releases the lock.
+    if (fd != -1)
+        ::close(fd);
+}
+
+QString ContentStore::path() const
+{
+    return m_path;
+}
+
+QByteArray ContentStore::key(const QImage &image, const QString &format, int quality)
+{
+    ContentKeyBuilder builder(image.size(), image.format(), format, quality);
+    builder.addBand(image);
+    return builder.result();
+}
+
+QString ContentStore::objectPath(const QByteArray &key) const
+{
+    const QString fileName = QString::fromLatin1(key);
+    return m_path + QLatin1String("/objects/") + fileName.left(2) + QLatin1Char('/') + fileName.mid(2);
+}
+
+bool ContentStore::contains(const QByteArray &key) const
+{
+    return QFile::exists(objectPath(key));
+}
+
+bool ContentStore::insert(const QByteArray &key, const QByteArray &data)
+{
+    const QString filePath = objectPath(key);
+    QDir().mkpath(QFileInfo(filePath).path());
+
+    QSaveFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    if (file.write(data) != data.size())
+        return false;
+
+    return file.commit();
+}
+
+QByteArray ContentStore::read(const QByteArray &key) const
+{
+    QFile file(objectPath(key));
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    return file.readAll();
+}
+
+static bool reflink(const QString &sourcePath, const QString &targetPath)
+{
+    const int source = ::open(QFile::encodeName(sourcePath).constData(), O_RDONLY | O_CLOEXEC);
+    if (source == -1)
+        return false;
+
+    const int target = ::open(QFile::encodeName(targetPath).constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (target == -1) {
+        ::close(source);
+        return false;
+    }
+
+    const bool ok = ::ioctl(target, FICLONE, source) == 0;
+
+    ::close(target);
+    ::close(source);
+
+    if (!ok)
+        QFile::remove(targetPath);
+
+    return ok;
+}
+
+bool ContentStore::link(const QByteArray &key, const QString &filePath) const
+{
+    const QString sourcePath = objectPath(key);
+
+    QFile::remove(filePath);
+
+    if (::link(QFile::encodeName(sourcePath).constData(), QFile::encodeName(filePath).constData()) == 0)
+        return true;
+    if (reflink(sourcePath, filePath))
+        return true;
+
+    return QFile::copy(sourcePath, filePath);
+}
+
+int ContentStore::collectGarbage() const
+{
+    // Objects that have been inserted but not linked yet have a single link as well.
+    const int fd = lock(LOCK_EX);
+    if (fd == -1)
+        return 0;
+
+    int removedCount = 0;
+
+    QDirIterator it(m_path + QLatin1String("/objects"), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        const QString filePath = it.next();
+
+        struct stat info;
+        if (::stat(QFile::encodeName(filePath).constData(), &info) != 0)
+            continue;
+        if (info.st_nlink > 1)
+            continue;
+
+        if (QFile::remove(filePath))
+            ++removedCount;
+    }
+
+    unlock(fd);
+
+    return removedCount;
+}
+
+// Different names of the same format, e.g. jpg and jpeg, yield the same key.
+static QByteArray canonicalFormat(const QString &format)
+{
+    const QByteArray lowerCaseFormat = format.toLower().toLatin1();
+    if (lowerCaseFormat == "jpeg")
+        return QByteArrayLiteral("jpg");
+    return lowerCaseFormat;
+}
+
+ContentKeyBuilder::ContentKeyBuilder(const QSize &size, QImage::Format pixelFormat, const QString &format, int quality)
+    : m_hash(QCryptographicHash::Sha256)
+    , m_format(canonicalFormat(format))
+{
+    QByteArray header = QByteArray::number(size.width()) + 'x'
+        + QByteArray::number(size.height()) + ':'
+        + QByteArray::number(int(pixelFormat)) + ':'
+        + m_format;
+    // The default quality keeps the keys of existing stores valid.
+    if (quality != -1)
+        header += ":q" + QByteArray::number(quality);
+    m_hash.addData(header);
+}
+
+void ContentKeyBuilder::addBand(const QImage &band)
+{
+    // Padding at the end of scan lines is not part of the content.
+    const int lineSize = (band.width() * band.depth() + 7) / 8;
+    for (int y = 0; y < band.height(); ++y)
+        m_hash.addData(reinterpret_cast<const char *>(band.constScanLine(y)), lineSize);
+}
+
+QByteArray ContentKeyBuilder::result() const
+{
+    return m_hash.result().toHex() + '.' + m_format;
+}
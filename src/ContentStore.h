@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QImage>
+#include <QString>
+
+/**
+ * The ContentStore class is a content-addressed store of encoded frames that can be
+ * shared by many wallpaper packages.
+ *
+ * Objects are keyed by the hash of the decoded pixel data and the encoding parameters.
+ * Packages refer to objects through hard links, or reflinks if hard links are not
+ * supported, so frames that are already in the store need not be encoded again.
+ */
+class Q_DECL_EXPORT ContentStore
+{
+public:
+    explicit ContentStore(const QString &path);
+
+    /**
+     * The Lock class keeps the garbage collector from running, in this or any other
+     * process, while it's alive. Objects must be looked up, inserted and linked under a
+     * lock, otherwise an object can be collected before a package links to it.
+     */
+    class Q_DECL_EXPORT Lock
+    {
+    public:
+        explicit Lock(const ContentStore *store);
+        ~Lock();
+
+    private:
+        int m_fd;
+
+        Q_DISABLE_COPY(Lock)
+    };
+
+    /**
+     * Returns the path of the root directory of the store.
+     */
+    QString path() const;
+
+    /**
+     * Returns the key of the given @p image encoded in the given @p format and with the
+     * given @p quality, -1 being the default quality of the format. Aliases of a format,
+     * e.g. jpg and jpeg, yield the same key.
+     */
+    static QByteArray key(const QImage &image, const QString &format, int quality = -1);
+
+    /**
+     * Returns @c true if the store contains an object with the given @p key.
+     */
+    bool contains(const QByteArray &key) const;
+
+    /**
+     * Stores the encoded @p data under the given @p key.
+     */
+    bool insert(const QByteArray &key, const QByteArray &data);
+
+    /**
+     * Returns the encoded data of the object with the given @p key, or a null byte array
+     * if there is no such object.
+     */
+    QByteArray read(const QByteArray &key) const;
+
+    /**
+     * Makes the file with the given @p filePath refer to the object with the given @p key.
+     *
+     * The file is hard linked to the object if possible, otherwise it is reflinked or,
+     * as the last resort, copied.
+     */
+    bool link(const QByteArray &key, const QString &filePath) const;
+
+    /**
+     * Removes objects that are not hard linked from any package. Returns the number of
+     * removed objects. Waits until no Lock is held on the store.
+     *
+     * Packages that got a reflinked or copied file don't depend on the store, so their
+     * objects are removed as well.
+     */
+    int collectGarbage() const;
+
+private:
+    QString objectPath(const QByteArray &key) const;
+    int lock(int operation) const;
+    static void unlock(int fd);
+
+    QString m_path;
+};
+
+/**
+ * The ContentKeyBuilder class computes the key of an image that is fed in horizontal
+ * bands. The result is the same as that of ContentStore::key() for the whole image.
+ */
+class Q_DECL_EXPORT ContentKeyBuilder
+{
+public:
+    ContentKeyBuilder(const QSize &size, QImage::Format pixelFormat, const QString &format, int quality = -1);
+
+    /**
+     * Adds the next @p band of rows to the key.
+     */
+    void addBand(const QImage &band);
+
+    /**
+     * Returns the key of all bands that have been added.
+     */
+    QByteArray result() const;
+
+private:
+    QCryptographicHash m_hash;
+    QByteArray m_format;
+};
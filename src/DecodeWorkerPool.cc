@@ -0,0 +1,721 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "DecodeWorkerPool.h"
+#include "ImportContext.h"
+#include "Loader.h"
+#include "Wallpaper.h"
+
+#include <QFile>
+#include <QHash>
+#include <QLoggingCategory>
+#include <QMutexLocker>
+
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(decodeWorker, "decodeworker")
+
+namespace {
+
+// The protocol between the pool and a worker. The pool sends the path of a file as a
+// single message. The worker answers with a ReplyHeader followed by an ImageHeader for
+// every image; each ImageHeader carries a memfd with the frame. Embedded thumbnails are
+// not sent, the parent scales previews down from the frames, which are decoded anyway.
+
+struct FrameHeader
+{
+    qint32 width;
+    qint32 height;
+    qint32 format;
+    qint32 bytesPerLine;
+    qint64 offset;
+};
+
+struct ReplyHeader
+{
+    qint32 type;
+    qint32 imageCount;
+};
+
+struct ImageHeader
+{
+    double azimuth;
+    double elevation;
+    double time;
+    FrameHeader frame;
+};
+
+struct MappedRegion
+{
+    void *data;
+    size_t size;
+};
+
+// Frames that importers decode in a worker are allocated in memfds, which are handed
+// to the pool as they are instead of being copied into fresh ones.
+class SharedFrameContext : public ImportContext
+{
+public:
+    QImage allocateFrame(const QSize &size, QImage::Format format) override;
+
+    /**
+     * Returns the memfd that backs the given @p frame and makes the caller responsible
+     * for closing it, or -1 if the frame has not been allocated by this context.
+     */
+    int takeMemory(const QImage &frame);
+
+private:
+    struct SharedFrame
+    {
+        SharedFrameContext *context;
+        void *data;
+        size_t size;
+    };
+
+    static void freeFrame(void *info);
+
+    QMutex m_mutex;
+    QHash<const void *, int> m_memory;
+};
+
+} // namespace
+
+static const int maximumImageCount = 1 << 16;
+
+static bool sendMessage(int socket, const void *data, size_t size, int fd = -1)
+{
+    iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = size;
+
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd != -1) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = ::sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+
+    return sent == ssize_t(size);
+}
+
+static bool receiveMessage(int socket, void *data, size_t size, int *fd = nullptr)
+{
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+        received = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+
+    int receivedFd = -1;
+    if (received > 0) {
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+                continue;
+            std::memcpy(&receivedFd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+
+    if (received != ssize_t(size) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || (receivedFd != -1 && !fd)) {
+        if (receivedFd != -1)
+            ::close(receivedFd);
+        return false;
+    }
+
+    if (fd)
+        *fd = receivedFd;
+
+    return true;
+}
+
+static bool waitForMessage(int socket, const QDeadlineTimer &deadline)
+{
+    pollfd descriptor = { socket, POLLIN, 0 };
+    for (;;) {
+        const qint64 remainingTime = deadline.remainingTime();
+        const int result = ::poll(&descriptor, 1, remainingTime > INT_MAX ? INT_MAX : int(remainingTime));
+        if (result > 0)
+            return true;
+        if (result == 0 && deadline.hasExpired())
+            return false;
+        if (result == -1 && errno != EINTR)
+            return false;
+    }
+}
+
+static qint64 frameBytes(const QImage &image)
+{
+    return qint64(image.bytesPerLine()) * image.height();
+}
+
+static qint64 pageAligned(qint64 size)
+{
+    const qint64 pageSize = ::sysconf(_SC_PAGESIZE);
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+static FrameHeader describeFrame(const QImage &image, qint64 offset)
+{
+    FrameHeader header = {};
+    if (image.isNull())
+        return header;
+
+    header.width = image.width();
+    header.height = image.height();
+    header.format = image.format();
+    header.bytesPerLine = image.bytesPerLine();
+    header.offset = offset;
+
+    return header;
+}
+
+// Color tables are not shared with the parent, so images that need one are converted.
+static QImage toShareableImage(const QImage &image)
+{
+    if (image.isNull() || image.format() > QImage::Format_Indexed8)
+        return image;
+    return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+}
+
+static int createMemory(qint64 size)
+{
+    const int fd = ::memfd_create("dynamic-wallpaper-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+        return -1;
+
+    if (::ftruncate(fd, size) == -1) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// The parent maps the memory directly, so it must not change under its feet. Sealing
+// fails while the memory is still mapped writable anywhere.
+static bool sealMemory(int fd)
+{
+    return ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != -1;
+}
+
+static int createSharedMemory(const QImage &frame)
+{
+    const qint64 size = frameBytes(frame);
+    const int fd = createMemory(size);
+    if (fd == -1)
+        return -1;
+
+    void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return -1;
+    }
+
+    std::memcpy(data, frame.constBits(), size);
+    ::munmap(data, size);
+
+    if (!sealMemory(fd)) {
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+QImage SharedFrameContext::allocateFrame(const QSize &size, QImage::Format format)
+{
+    if (size.isEmpty() || format <= QImage::Format_Indexed8 || format >= QImage::NImageFormats)
+        return QImage();
+
+    const qint64 bytesPerLine = (qint64(size.width()) * QImage::toPixelFormat(format).bitsPerPixel() + 31) / 32 * 4;
+    if (bytesPerLine > INT_MAX)
+        return QImage();
+
+    const qint64 bytes = bytesPerLine * size.height();
+    const int fd = createMemory(bytes);
+    if (fd == -1)
+        return QImage();
+
+    void *data = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return QImage();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_memory.insert(data, fd);
+    locker.unlock();
+
+    return QImage(static_cast<uchar *>(data), size.width(), size.height(), int(bytesPerLine), format,
+                  freeFrame, new SharedFrame { this, data, size_t(bytes) });
+}
+
+int SharedFrameContext::takeMemory(const QImage &frame)
+{
+    QMutexLocker locker(&m_mutex);
+    const int fd = m_memory.value(frame.constBits(), -1);
+    m_memory.remove(frame.constBits());
+    return fd;
+}
+
+void SharedFrameContext::freeFrame(void *info)
+{
+    SharedFrame *frame = static_cast<SharedFrame *>(info);
+    ::munmap(frame->data, frame->size);
+
+    // The memory of a frame that has been spilled or failed to send goes away with it.
+    QMutexLocker locker(&frame->context->m_mutex);
+    const int fd = frame->context->m_memory.value(frame->data, -1);
+    frame->context->m_memory.remove(frame->data);
+    locker.unlock();
+    if (fd != -1)
+        ::close(fd);
+
+    delete frame;
+}
+
+static bool sendImage(int socket, const Wallpaper::Image &image, const FrameHeader &frame, int fd)
+{
+    ImageHeader header = {};
+    header.azimuth = image.azimuth;
+    header.elevation = image.elevation;
+    header.time = image.time;
+
+    // A frame that couldn't be decoded or shared is sent without a file descriptor.
+    if (fd != -1)
+        header.frame = frame;
+
+    const bool ok = sendMessage(socket, &header, sizeof(header), fd);
+    if (fd != -1)
+        ::close(fd);
+
+    return ok;
+}
+
+static bool sendWallpaper(int socket, const Wallpaper *wallpaper, SharedFrameContext *context)
+{
+    ReplyHeader header = {};
+    header.type = wallpaper ? wallpaper->type() : Wallpaper::Unknown;
+    header.imageCount = wallpaper ? wallpaper->imageCount() : 0;
+    if (!sendMessage(socket, &header, sizeof(header)))
+        return false;
+    if (!wallpaper)
+        return true;
+
+    const Wallpaper::ImageRange images = wallpaper->images();
+    for (int i = 0; i < images.count(); ++i) {
+        const QImage &frame = wallpaper->pinImage(i);
+
+        // Frames that have been decoded into shared memory are sent as they are, others,
+        // e.g. ones that have been spilled in between, are copied into a fresh memfd.
+        FrameHeader frameHeader = {};
+        int fd = -1;
+        bool shared = false;
+        if (!frame.isNull()) {
+            fd = context->takeMemory(frame);
+            shared = fd != -1;
+            if (shared) {
+                frameHeader = describeFrame(frame, 0);
+            } else {
+                const QImage sharedFrame = toShareableImage(frame);
+                fd = createSharedMemory(sharedFrame);
+                frameHeader = describeFrame(sharedFrame, 0);
+            }
+            wallpaper->unpinImage(i);
+        }
+
+        // Releasing the frame unmaps the writable mapping of the worker.
+        wallpaper->releaseImage(i);
+        if (shared && !sealMemory(fd)) {
+            ::close(fd);
+            fd = -1;
+        }
+
+        if (!sendImage(socket, images[i], frameHeader, fd))
+            return false;
+    }
+
+    return true;
+}
+
+static void unmapFrame(void *info)
+{
+    MappedRegion *region = static_cast<MappedRegion *>(info);
+    ::munmap(region->data, region->size);
+    delete region;
+}
+
+static QImage mapFrame(int fd, qint64 fileSize, const FrameHeader &header)
+{
+    if (header.width <= 0 || header.height <= 0)
+        return QImage();
+    if (header.format <= QImage::Format_Indexed8 || header.format >= QImage::NImageFormats)
+        return QImage();
+
+    const QImage::Format format = QImage::Format(header.format);
+    const qint64 minimumBytesPerLine = (qint64(header.width) * QImage::toPixelFormat(format).bitsPerPixel() + 7) / 8;
+    if (header.bytesPerLine < minimumBytesPerLine)
+        return QImage();
+
+    const qint64 size = qint64(header.bytesPerLine) * header.height;
+    if (header.offset < 0 || header.offset != pageAligned(header.offset) || header.offset > fileSize - size)
+        return QImage();
+
+    void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, header.offset);
+    if (data == MAP_FAILED)
+        return QImage();
+
+    return QImage(static_cast<const uchar *>(data), header.width, header.height, header.bytesPerLine, format,
+                  unmapFrame, new MappedRegion { data, size_t(size) });
+}
+
+static bool isSealed(int fd, qint64 *size)
+{
+    const int seals = ::fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE))
+        return false;
+
+    struct stat status;
+    if (::fstat(fd, &status) == -1)
+        return false;
+    *size = status.st_size;
+
+    return true;
+}
+
+DecodeWorkerPool::DecodeWorkerPool(const QString &program, const QStringList &arguments, int count)
+    : m_program(QFile::encodeName(program))
+{
+    for (const QString &argument : arguments)
+        m_arguments.append(argument.toLocal8Bit());
+
+    for (int i = 0; i < count; ++i) {
+        Worker worker;
+        if (!spawn(&worker)) {
+            qCWarning(decodeWorker, "Could not spawn a decode worker: %s", strerror(errno));
+            continue;
+        }
+        m_idleWorkers.append(worker);
+        ++m_count;
+    }
+}
+
+DecodeWorkerPool::~DecodeWorkerPool()
+{
+    // Idle workers exit as soon as they notice that their socket has been closed.
+    for (Worker &worker : m_idleWorkers) {
+        ::close(worker.socket);
+        while (::waitpid(worker.pid, nullptr, 0) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+int DecodeWorkerPool::count() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_count;
+}
+
+void DecodeWorkerPool::setTimeout(int msecs)
+{
+    QMutexLocker locker(&m_mutex);
+    m_timeout = msecs;
+}
+
+bool DecodeWorkerPool::spawn(Worker *worker)
+{
+    int sockets[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+        return false;
+
+    // Everything the child needs is prepared up front, since only async-signal-safe
+    // functions may be called between fork() and exec() in a multi-threaded process.
+    QList<QByteArray> arguments = m_arguments;
+    arguments.prepend(m_program);
+    arguments.append(QByteArray::number(sockets[1]));
+
+    std::vector<char *> argv;
+    for (QByteArray &argument : arguments)
+        argv.push_back(argument.data());
+    argv.push_back(nullptr);
+
+    const pid_t pid = ::fork();
+    if (pid == -1) {
+        ::close(sockets[0]);
+        ::close(sockets[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        ::fcntl(sockets[1], F_SETFD, 0);
+        ::execv(argv[0], argv.data());
+        ::_exit(127);
+    }
+
+    ::close(sockets[1]);
+
+    worker->pid = pid;
+    worker->socket = sockets[0];
+
+    return true;
+}
+
+void DecodeWorkerPool::terminate(Worker *worker)
+{
+    ::close(worker->socket);
+
+    int status = 0;
+    pid_t result;
+    do {
+        result = ::waitpid(worker->pid, &status, WNOHANG);
+    } while (result == -1 && errno == EINTR);
+
+    if (result == worker->pid) {
+        if (WIFSIGNALED(status))
+            qCWarning(decodeWorker, "Decode worker %d was killed by signal %d", worker->pid, WTERMSIG(status));
+        else
+            qCWarning(decodeWorker, "Decode worker %d exited with status %d", worker->pid, WEXITSTATUS(status));
+    } else {
+        // The worker is alive but misbehaving, e.g. it has sent malformed data.
+        ::kill(worker->pid, SIGKILL);
+        while (::waitpid(worker->pid, nullptr, 0) == -1 && errno == EINTR) {
+        }
+    }
+
+    worker->pid = -1;
+    worker->socket = -1;
+}
+
+bool DecodeWorkerPool::receive(const Worker &worker, const QDeadlineTimer &deadline, std::unique_ptr<Wallpaper> *wallpaper)
+{
+    const auto waitForWorker = [&worker, &deadline]() {
+        if (waitForMessage(worker.socket, deadline))
+            return true;
+        qCWarning(decodeWorker, "Decode worker %d has not answered in time", worker.pid);
+        return false;
+    };
+
+    ReplyHeader header;
+    if (!waitForWorker() || !receiveMessage(worker.socket, &header, sizeof(header)))
+        return false;
+
+    // The worker is fine, it just couldn't load the file.
+    if (header.type == Wallpaper::Unknown && !header.imageCount)
+        return true;
+
+    if (header.type != Wallpaper::Solar && header.type != Wallpaper::Timed)
+        return false;
+    if (header.imageCount <= 0 || header.imageCount > maximumImageCount)
+        return false;
+
+    bool complete = true;
+
+    std::vector<Wallpaper::Image> images(header.imageCount);
+    for (Wallpaper::Image &image : images) {
+        ImageHeader imageHeader;
+        int fd = -1;
+        if (!waitForWorker() || !receiveMessage(worker.socket, &imageHeader, sizeof(imageHeader), &fd))
+            return false;
+        if (fd == -1) {
+            complete = false;
+            continue;
+        }
+
+        qint64 fileSize = 0;
+        if (isSealed(fd, &fileSize))
+            image.data = mapFrame(fd, fileSize, imageHeader.frame);
+        ::close(fd);
+
+        if (image.data.isNull())
+            return false;
+
+        image.azimuth = imageHeader.azimuth;
+        image.elevation = imageHeader.elevation;
+        image.time = imageHeader.time;
+    }
+
+    if (complete)
+        *wallpaper = std::make_unique<Wallpaper>(Wallpaper::Type(header.type), std::move(images));
+
+    return true;
+}
+
+std::unique_ptr<Wallpaper> DecodeWorkerPool::load(const QString &fileName)
+{
+    const QByteArray request = QFile::encodeName(fileName);
+    if (request.size() >= PATH_MAX) {
+        qCWarning(decodeWorker, "%s is too long", qPrintable(fileName));
+        return nullptr;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    while (m_idleWorkers.isEmpty()) {
+        if (!m_count)
+            return nullptr;
+        m_workerAvailable.wait(&m_mutex);
+    }
+    Worker worker = m_idleWorkers.takeLast();
+    const QDeadlineTimer deadline(m_timeout);
+    locker.unlock();
+
+    // A hung worker is treated like a crashed one, it's killed and replaced.
+    std::unique_ptr<Wallpaper> wallpaper;
+    if (sendMessage(worker.socket, request.constData(), request.size()) && receive(worker, deadline, &wallpaper)) {
+        locker.relock();
+        m_idleWorkers.append(worker);
+        m_workerAvailable.wakeOne();
+        return wallpaper;
+    }
+
+    qCWarning(decodeWorker, "Decode worker %d failed while decoding %s", worker.pid, qPrintable(fileName));
+    terminate(&worker);
+    const bool respawned = spawn(&worker);
+
+    locker.relock();
+    if (respawned) {
+        m_idleWorkers.append(worker);
+    } else {
+        qCWarning(decodeWorker, "Could not restart the decode worker: %s", strerror(errno));
+        --m_count;
+    }
+    m_workerAvailable.wakeAll();
+
+    return nullptr;
+}
+
+static bool restrictSystemCalls()
+{
+#if defined(__x86_64__)
+    const __u32 architecture = AUDIT_ARCH_X86_64;
+#elif defined(__aarch64__)
+    const __u32 architecture = AUDIT_ARCH_AARCH64;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+
+    // Decoding needs little more than reading files, mapping memory, spawning threads
+    // and talking to the pool over the socket that is already open.
+    static const int deniedSystemCalls[] = {
+        SYS_execve, SYS_execveat,
+        SYS_ptrace, SYS_process_vm_readv, SYS_process_vm_writev,
+        SYS_socket, SYS_socketpair, SYS_connect, SYS_bind, SYS_listen, SYS_accept, SYS_accept4,
+        SYS_mount, SYS_umount2, SYS_pivot_root, SYS_chroot, SYS_unshare, SYS_setns,
+        SYS_bpf, SYS_perf_event_open, SYS_keyctl, SYS_add_key, SYS_request_key,
+        SYS_init_module, SYS_finit_module, SYS_delete_module, SYS_kexec_load, SYS_reboot,
+    };
+
+    std::vector<sock_filter> filter {
+        // System calls of other architectures could bypass the filter.
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, architecture, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+    };
+#if defined(__x86_64__)
+    // So could x32 system calls.
+    filter.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1));
+    filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL));
+#endif
+    for (int systemCall : deniedSystemCalls) {
+        filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __u32(systemCall), 0, 1));
+        filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | (EPERM & SECCOMP_RET_DATA)));
+    }
+    filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+
+    sock_fprog program = {};
+    program.len = static_cast<unsigned short>(filter.size());
+    program.filter = filter.data();
+
+    // Workers never need more privileges than they have been started with, which also
+    // allows unprivileged processes to install the filter. Threads that have already
+    // been started are covered as well.
+    if (::prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
+        return false;
+    return ::syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_TSYNC, &program) == 0;
+}
+
+int DecodeWorkerPool::serve(int socket, const Loader *loader)
+{
+    // The importer plugins have been loaded by now.
+    if (!restrictSystemCalls())
+        qCWarning(decodeWorker, "Could not restrict the system calls of the decode worker: %s", strerror(errno));
+
+    // Frames are freed before the context goes away, each wallpaper is gone by the end
+    // of the iteration that has loaded it.
+    SharedFrameContext context;
+
+    QByteArray request(PATH_MAX, Qt::Uninitialized);
+    for (;;) {
+        ssize_t size;
+        do {
+            size = ::recv(socket, request.data(), request.size(), 0);
+        } while (size == -1 && errno == EINTR);
+
+        // The pool has gone away.
+        if (size <= 0)
+            return 0;
+
+        const QString fileName = QFile::decodeName(QByteArray(request.constData(), size));
+        const std::unique_ptr<Wallpaper> wallpaper = loader->load(fileName, &context);
+        if (!sendWallpaper(socket, wallpaper.get(), &context))
+            return 1;
+    }
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QDeadlineTimer>
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <memory>
+
+#include <sys/types.h>
+
+class Loader;
+class Wallpaper;
+
+/**
+ * The DecodeWorkerPool class decodes dynamic wallpapers in a pool of worker processes,
+ * so a malformed file that crashes or hangs an importer plugin takes down only the
+ * worker that has been decoding it.
+ *
+ * Workers run under a seccomp filter that keeps them from executing programs, opening
+ * sockets, tracing other processes and changing the system, so an importer that has
+ * been exploited through a malformed file can do little beyond reading files.
+ *
+ * Workers are spawned up front by executing the given program with the socket that
+ * connects them to the pool. Importers decode frames into memfds, which are sealed,
+ * passed back over the socket and mapped by the parent process; the pixel data itself
+ * never goes through the socket. Embedded thumbnails are not passed back, so previews
+ * of wallpapers that have been loaded by workers are scaled down from the frames. A worker that crashes or sends malformed
+ * data, or doesn't answer in time, is replaced with a fresh one and only the file that
+ * it has been decoding fails.
+ */
+class Q_DECL_EXPORT DecodeWorkerPool
+{
+public:
+    /**
+     * Spawns @p count workers by executing @p program with the given @p arguments
+     * followed by the file descriptor of the socket. The program is expected to call
+     * serve() with that file descriptor.
+     */
+    DecodeWorkerPool(const QString &program, const QStringList &arguments, int count);
+    ~DecodeWorkerPool();
+
+    /**
+     * Returns the number of workers that are alive.
+     */
+    int count() const;
+
+    /**
+     * Sets how long a worker may take to decode a file, in milliseconds, before it's
+     * considered hung and replaced. The default is ten minutes; -1 waits forever.
+     */
+    void setTimeout(int msecs);
+
+    /**
+     * Decodes the dynamic wallpaper with the given @p fileName in one of the workers.
+     * This method blocks until a worker is available and is thread-safe.
+     *
+     * This method will return @c null if the wallpaper couldn't be loaded or the worker
+     * has crashed while decoding it.
+     */
+    std::unique_ptr<Wallpaper> load(const QString &fileName);
+
+    /**
+     * Serves decode requests that come from the pool over the given @p socket until the
+     * pool goes away. This is the main loop of a worker process.
+     */
+    static int serve(int socket, const Loader *loader);
+
+private:
+    struct Worker
+    {
+        pid_t pid = -1;
+        int socket = -1;
+    };
+
+    bool spawn(Worker *worker);
+    void terminate(Worker *worker);
+    bool receive(const Worker &worker, const QDeadlineTimer &deadline, std::unique_ptr<Wallpaper> *wallpaper);
+
+    QByteArray m_program;
+    QList<QByteArray> m_arguments;
+    QVector<Worker> m_idleWorkers;
+    int m_count = 0;
+    int m_timeout = 10 * 60 * 1000;
+    mutable QMutex m_mutex;
+    QWaitCondition m_workerAvailable;
+
+    Q_DISABLE_COPY(DecodeWorkerPool)
+};
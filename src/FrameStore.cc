@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "FrameStore.h"
+#include "BufferPool.h"
+
+#include <QDir>
+#include <QLoggingCategory>
+#include <QMutexLocker>
+#include <QTemporaryFile>
+
+#include <algorithm>
+
+Q_LOGGING_CATEGORY(frameStore, "framestore")
+
+FrameStore::FrameStore(int count, MemoryBudget *budget)
+    : m_frames(count)
+    , m_budget(budget)
+{
+    m_budget->addReclaimer(this);
+}
+
+FrameStore::~FrameStore()
+{
+    m_budget->removeReclaimer(this);
+
+    for (const Frame &frame : qAsConst(m_frames)) {
+        if (!frame.image.isNull() && !frame.pooled)
+            m_budget->release(frameSize(frame));
+    }
+}
+
+int FrameStore::count() const
+{
+    return m_frames.count();
+}
+
+qint64 FrameStore::frameSize(const Frame &frame)
+{
+    return qint64(frame.bytesPerLine) * frame.size.height();
+}
+
+void FrameStore::describe(Frame &frame, const QImage &image)
+{
+    frame.size = image.size();
+    frame.format = image.format();
+    frame.bytesPerLine = image.bytesPerLine();
+}
+
+void FrameStore::setLoader(std::function<bool(int)> loader)
+{
+    m_loader = loader;
+}
+
+void FrameStore::setBandLoader(std::function<std::unique_ptr<BandReader>(int)> loader)
+{
+    m_bandLoader = loader;
+}
+
+void FrameStore::insert(int index, QImage &&image)
+{
+    QMutexLocker locker(&m_mutex);
+    Frame &frame = m_frames[index];
+    describe(frame, image);
+    frame.image = std::move(image);
+    frame.pooled = false;
+}
+
+void FrameStore::adopt(int index, QImage &&image)
+{
+    const qint64 bytes = qint64(image.bytesPerLine()) * image.height();
+    if (m_budget->acquire(bytes)) {
+        insert(index, std::move(image));
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    Frame &frame = m_frames[index];
+    describe(frame, image);
+    frame.image = std::move(image);
+    frame.pooled = false;
+    if (spill(frame)) {
+        frame.image = QImage();
+        return;
+    }
+
+    // The frame would be lost otherwise, so it stays in memory over the budget.
+    qCWarning(frameStore, "Could not spill frame %d, keeping it in memory", index);
+    m_budget->forceAcquire(frameSize(frame));
+}
+
+const QImage &FrameStore::pin(int index)
+{
+    static const QImage nullImage;
+
+    QMutexLocker locker(&m_mutex);
+
+    Frame &frame = m_frames[index];
+    if (frame.released)
+        return nullImage;
+
+    // Concurrent pins of a deferred frame wait for the thread that decodes it rather
+    // than decoding it twice. The waiting thread doesn't count as making progress, so
+    // the decoding thread can't block on memory the waiting thread holds.
+    while (frame.loading)
+        m_budget->wait(&m_loadedCondition, &m_mutex);
+
+    if (frame.image.isNull() && frame.spillOffset == -1) {
+        if (!m_loader || frame.undecodable)
+            return nullImage;
+
+        frame.loading = true;
+        locker.unlock();
+        const bool loaded = m_loader(index);
+        locker.relock();
+        frame.loading = false;
+        frame.undecodable = !loaded;
+        m_loadedCondition.wakeAll();
+        if (!loaded)
+            return nullImage;
+    }
+
+    if (frame.image.isNull()) {
+        if (frame.spillOffset == -1)
+            return nullImage;
+
+        // The buffer pool charges the frame to the budget and may reclaim memory, so
+        // the frame is allocated without the lock.
+        locker.unlock();
+        QImage image = BufferPool::self()->createImage(frame.size, frame.format);
+        if (image.isNull()) {
+            qCWarning(frameStore, "Frame %d does not fit in the memory budget", index);
+            return nullImage;
+        }
+        locker.relock();
+
+        // Another thread might have faulted in the frame while the lock was released.
+        if (frame.image.isNull()) {
+            if (!unspill(frame, &image)) {
+                qCWarning(frameStore, "Could not read spilled frame %d", index);
+                return nullImage;
+            }
+            frame.image = std::move(image);
+            frame.pooled = true;
+        }
+    }
+
+    ++frame.pinCount;
+    frame.holds.append(m_budget->hold());
+
+    return frame.image;
+}
+
+void FrameStore::unpin(int index)
+{
+    QMutexLocker locker(&m_mutex);
+    Frame &frame = m_frames[index];
+    // Every pin holds the frame on its own, so the pin can be dropped on any thread.
+    const quint64 hold = frame.holds.takeLast();
+    if (!--frame.pinCount && frame.released)
+        drop(frame);
+    locker.unlock();
+
+    m_budget->unhold(hold);
+}
+
+class FrameStore::SpillBandReader : public BandReader
+{
+public:
+    SpillBandReader(FrameStore *store, const Frame &frame)
+        : m_store(store)
+        , m_size(frame.size)
+        , m_format(frame.format)
+        , m_bytesPerLine(frame.bytesPerLine)
+        , m_spillOffset(frame.spillOffset)
+        , m_bandHeight(std::min(bandHeight(frame.bytesPerLine), frame.size.height()))
+    {
+    }
+
+    QSize size() const override
+    {
+        return m_size;
+    }
+
+    QImage::Format format() const override
+    {
+        return m_format;
+    }
+
+    QImage readBand() override
+    {
+        if (m_y >= m_size.height())
+            return QImage();
+
+        const int rows = std::min(m_bandHeight, m_size.height() - m_y);
+        if (m_band.isNull()) {
+            m_band = BufferPool::self()->createImage(QSize(m_size.width(), m_bandHeight), m_format);
+            if (m_band.isNull())
+                return QImage();
+        }
+
+        // Spilled data is never overwritten, only the position of the file is shared.
+        const qint64 bytes = qint64(m_bytesPerLine) * rows;
+        QMutexLocker locker(&m_store->m_mutex);
+        if (m_band.bytesPerLine() == m_bytesPerLine) {
+            if (!m_store->m_spillFile->seek(m_spillOffset + qint64(m_y) * m_bytesPerLine))
+                return QImage();
+            if (m_store->m_spillFile->read(reinterpret_cast<char *>(m_band.bits()), bytes) != bytes)
+                return QImage();
+        } else {
+            const int lineSize = std::min(m_band.bytesPerLine(), m_bytesPerLine);
+            for (int row = 0; row < rows; ++row) {
+                if (!m_store->m_spillFile->seek(m_spillOffset + qint64(m_y + row) * m_bytesPerLine))
+                    return QImage();
+                if (m_store->m_spillFile->read(reinterpret_cast<char *>(m_band.scanLine(row)), lineSize) != lineSize)
+                    return QImage();
+            }
+        }
+        locker.unlock();
+
+        m_y += rows;
+
+        return QImage(m_band.constBits(), m_size.width(), rows, m_band.bytesPerLine(), m_format);
+    }
+
+private:
+    FrameStore *m_store;
+    QSize m_size;
+    QImage::Format m_format;
+    int m_bytesPerLine;
+    qint64 m_spillOffset;
+    int m_bandHeight;
+    int m_y = 0;
+    QImage m_band;
+};
+
+std::unique_ptr<BandReader> FrameStore::openBands(int index)
+{
+    QMutexLocker locker(&m_mutex);
+
+    const Frame &frame = m_frames.at(index);
+    if (frame.released)
+        return nullptr;
+    if (frame.image.isNull() && frame.spillOffset != -1)
+        return std::make_unique<SpillBandReader>(this, frame);
+
+    const bool loaded = !frame.image.isNull();
+    locker.unlock();
+
+    if (!loaded && m_bandLoader) {
+        if (std::unique_ptr<BandReader> reader = m_bandLoader(index))
+            return reader;
+    }
+
+    const QImage &image = pin(index);
+    if (image.isNull())
+        return nullptr;
+
+    return std::make_unique<ImageBandReader>(image, [this, index]() {
+        unpin(index);
+    });
+}
+
+void FrameStore::release(int index)
+{
+    QMutexLocker locker(&m_mutex);
+    Frame &frame = m_frames[index];
+    frame.released = true;
+    if (!frame.pinCount)
+        drop(frame);
+}
+
+void FrameStore::remove(int index)
+{
+    QMutexLocker locker(&m_mutex);
+    drop(m_frames[index]);
+    m_frames.remove(index);
+}
+
+void FrameStore::drop(Frame &frame)
+{
+    if (frame.image.isNull())
+        return;
+
+    frame.image = QImage();
+    if (!frame.pooled)
+        m_budget->release(frameSize(frame));
+}
+
+qint64 FrameStore::reclaim(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+
+    qint64 reclaimed = 0;
+
+    // Frames are usually consumed in order, so the ones with the highest indices are
+    // needed last. Frames that have been spilled before can be dropped for free, so
+    // they go first.
+    for (int pass = 0; pass < 2 && reclaimed < bytes; ++pass) {
+        for (int i = m_frames.count() - 1; i >= 0 && reclaimed < bytes; --i) {
+            Frame &frame = m_frames[i];
+            if (frame.image.isNull() || frame.pinCount)
+                continue;
+            if (pass == 0 && frame.spillOffset == -1)
+                continue;
+            if (!spill(frame))
+                continue;
+
+            frame.image = QImage();
+
+            // Pooled frames go back to the pool. They are counted anyway, so the budget
+            // asks again and the pool frees the idle buffer.
+            const qint64 size = frameSize(frame);
+            if (!frame.pooled)
+                m_budget->release(size);
+            reclaimed += size;
+        }
+    }
+
+    return reclaimed;
+}
+
+bool FrameStore::spill(Frame &frame)
+{
+    if (frame.spillOffset != -1)
+        return true;
+
+    if (!m_spillFile) {
+        m_spillFile.reset(new QTemporaryFile(QDir::tempPath() + QLatin1String("/dynamic-wallpaper-XXXXXX.spill")));
+        if (!m_spillFile->open()) {
+            m_spillFile.reset();
+            return false;
+        }
+    }
+
+    const qint64 offset = m_spillFile->size();
+    if (!m_spillFile->seek(offset))
+        return false;
+
+    const qint64 bytes = frameSize(frame);
+    const char *data = reinterpret_cast<const char *>(frame.image.constBits());
+    if (m_spillFile->write(data, bytes) != bytes)
+        return false;
+
+    frame.spillOffset = offset;
+
+    return true;
+}
+
+bool FrameStore::unspill(const Frame &frame, QImage *image)
+{
+    if (image->bytesPerLine() == frame.bytesPerLine) {
+        const qint64 bytes = frameSize(frame);
+        if (!m_spillFile->seek(frame.spillOffset))
+            return false;
+        return m_spillFile->read(reinterpret_cast<char *>(image->bits()), bytes) == bytes;
+    }
+
+    const int bytesPerLine = std::min(image->bytesPerLine(), frame.bytesPerLine);
+    for (int y = 0; y < image->height(); ++y) {
+        if (!m_spillFile->seek(frame.spillOffset + qint64(y) * frame.bytesPerLine))
+            return false;
+        if (m_spillFile->read(reinterpret_cast<char *>(image->scanLine(y)), bytesPerLine) != bytesPerLine)
+            return false;
+    }
+
+    return true;
+}
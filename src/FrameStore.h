@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "BandReader.h"
+#include "MemoryBudget.h"
+
+#include <QImage>
+#include <QMutex>
+#include <QVector>
+#include <QWaitCondition>
+
+#include <functional>
+#include <memory>
+
+class QTemporaryFile;
+
+/**
+ * The FrameStore class owns the decoded frames of a dynamic wallpaper.
+ *
+ * The pixel data of every frame is charged to the memory budget. If the budget runs
+ * out of memory, frames that are not pinned are spilled to a temporary file and faulted
+ * back in the next time they are pinned.
+ */
+class Q_DECL_EXPORT FrameStore : public MemoryBudget::Reclaimer
+{
+public:
+    explicit FrameStore(int count, MemoryBudget *budget = MemoryBudget::self());
+    ~FrameStore() override;
+
+    /**
+     * Returns the number of frames in the store.
+     */
+    int count() const;
+
+    /**
+     * Sets the function that decodes frames that haven't been inserted yet when they
+     * are pinned for the first time. The function is expected to insert() the frame.
+     */
+    void setLoader(std::function<bool(int)> loader);
+
+    /**
+     * Sets the function that opens frames that haven't been loaded yet as a sequence of
+     * bands, see openBands(). The function may return @c null if it can't read the frame
+     * in bands, in which case the frame is loaded as a whole.
+     */
+    void setBandLoader(std::function<std::unique_ptr<BandReader>(int)> loader);
+
+    /**
+     * Stores the frame at the given @p index. The pixel data of the frame must have
+     * been already charged to the memory budget by the caller.
+     */
+    void insert(int index, QImage &&image);
+
+    /**
+     * Stores the frame at the given @p index and charges its pixel data to the memory
+     * budget. If the frame doesn't fit, it's written straight to the spill file. If it
+     * can't be spilled either, it's kept in memory and charged over the limit.
+     */
+    void adopt(int index, QImage &&image);
+
+    /**
+     * Returns the frame at the given @p index, faulting it back in if it has been
+     * spilled or decoding it if it hasn't been loaded yet. The frame won't be spilled
+     * until it's unpinned.
+     *
+     * The returned reference points into the store and stays valid until the frame is
+     * unpinned, so callers never share or copy the pixel data.
+     *
+     * This method will return a null image if the frame cannot fit in the memory budget
+     * or it has been released. Such a pin must not be matched by unpin().
+     */
+    const QImage &pin(int index);
+
+    /**
+     * Allows the frame at the given @p index to be spilled again.
+     */
+    void unpin(int index);
+
+    /**
+     * Opens the frame at the given @p index for reading in bands. Spilled frames are
+     * read back from the disk one band at a time and frames that haven't been loaded yet
+     * are decoded in bands if the band loader supports it; otherwise the frame is pinned
+     * until the reader is destroyed. The reader must not outlive the store.
+     *
+     * This method will return @c null if the frame cannot be read.
+     */
+    std::unique_ptr<BandReader> openBands(int index);
+
+    /**
+     * Frees the frame at the given @p index for good and returns its memory to the
+     * budget. A released frame is neither faulted back in nor decoded again. If the
+     * frame is pinned, it's freed when the last pin goes away.
+     */
+    void release(int index);
+
+    /**
+     * Removes the frame at the given @p index and returns its memory to the budget.
+     * Frames after it move down by one, so this must be called before the store is
+     * handed out. The frame must not be pinned.
+     */
+    void remove(int index);
+
+    qint64 reclaim(qint64 bytes) override;
+
+private:
+    class SpillBandReader;
+
+    struct Frame
+    {
+        QImage image;
+        QSize size;
+        QImage::Format format = QImage::Format_Invalid;
+        int bytesPerLine = 0;
+        qint64 spillOffset = -1;
+        QVector<quint64> holds;
+        int pinCount = 0;
+        // The pixel data comes from the buffer pool, which charges it to the budget.
+        bool pooled = false;
+        bool loading = false;
+        bool undecodable = false;
+        bool released = false;
+    };
+
+    static qint64 frameSize(const Frame &frame);
+    void describe(Frame &frame, const QImage &image);
+    void drop(Frame &frame);
+    bool spill(Frame &frame);
+    bool unspill(const Frame &frame, QImage *image);
+
+    QVector<Frame> m_frames;
+    std::unique_ptr<QTemporaryFile> m_spillFile;
+    std::function<bool(int)> m_loader;
+    std::function<std::unique_ptr<BandReader>(int)> m_bandLoader;
+    mutable QMutex m_mutex;
+    QWaitCondition m_loadedCondition;
+    MemoryBudget *m_budget;
+
+    Q_DISABLE_COPY(FrameStore)
+};
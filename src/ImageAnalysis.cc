@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ImageAnalysis.h"
+
+#include <QSet>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+static const int maximumSampleRows = 256;
+static const int maximumSampleColumns = 512;
+static const int maximumColorCount = 4096;
+
+// A luma step of this size between neighbouring samples is a hard edge.
+static const int edgeThreshold = 32;
+
+// Line art has hard edges between mostly flat runs, which make for a low gradient
+// entropy. Paletted content may be a little busier.
+static const int palettedColorCount = 256;
+static const qreal syntheticGradientEntropy = 2;
+static const qreal palettedGradientEntropy = 3;
+static const qreal minimumEdgeRatio = 0.005;
+
+static void readSampleRow(const QImage &image, int y, int columnStep, QRgb *row, int columnCount)
+{
+    const uchar *scanLine = image.constScanLine(y);
+
+    switch (image.format()) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied: {
+        const QRgb *pixels = reinterpret_cast<const QRgb *>(scanLine);
+        for (int x = 0; x < columnCount; ++x)
+            row[x] = pixels[x * columnStep];
+        break;
+    }
+    case QImage::Format_RGB888:
+        for (int x = 0; x < columnCount; ++x) {
+            const uchar *pixel = scanLine + x * columnStep * 3;
+            row[x] = qRgb(pixel[0], pixel[1], pixel[2]);
+        }
+        break;
+    default:
+        for (int x = 0; x < columnCount; ++x)
+            row[x] = image.pixel(x * columnStep, y);
+        break;
+    }
+}
+
+ImageAnalysis::ImageAnalysis(const QImage &image)
+{
+    if (image.isNull() || image.width() < 2)
+        return;
+
+    const int rowStep = std::max(1, image.height() / maximumSampleRows);
+    const int columnStep = std::max(1, image.width() / maximumSampleColumns);
+    const int columnCount = image.width() / columnStep;
+
+    std::vector<QRgb> row(columnCount);
+    std::vector<int> luma(columnCount);
+    std::vector<int> gradients(columnCount - 1);
+    std::array<qint64, 256> histogram {};
+    QSet<QRgb> colors;
+    qint64 gradientCount = 0;
+    qint64 edgeCount = 0;
+
+    for (int y = 0; y < image.height(); y += rowStep) {
+        readSampleRow(image, y, columnStep, row.data(), columnCount);
+
+        // These loops have no branches, so release builds vectorise them.
+        for (int x = 0; x < columnCount; ++x)
+            luma[x] = (qRed(row[x]) * 77 + qGreen(row[x]) * 150 + qBlue(row[x]) * 29) >> 8;
+        for (int x = 1; x < columnCount; ++x)
+            gradients[x - 1] = std::abs(luma[x] - luma[x - 1]);
+        for (int x = 0; x < columnCount - 1; ++x)
+            edgeCount += gradients[x] >= edgeThreshold;
+
+        for (int x = 0; x < columnCount - 1; ++x)
+            ++histogram[gradients[x]];
+        gradientCount += columnCount - 1;
+
+        for (int x = 0; x < columnCount && colors.count() < maximumColorCount; ++x)
+            colors.insert(row[x] & RGB_MASK);
+    }
+
+    for (qint64 count : histogram) {
+        if (!count)
+            continue;
+        const qreal probability = qreal(count) / gradientCount;
+        m_gradientEntropy -= probability * std::log2(probability);
+    }
+
+    m_edgeRatio = qreal(edgeCount) / gradientCount;
+    m_colorCount = colors.count();
+}
+
+int ImageAnalysis::colorCount() const
+{
+    return m_colorCount;
+}
+
+qreal ImageAnalysis::gradientEntropy() const
+{
+    return m_gradientEntropy;
+}
+
+qreal ImageAnalysis::edgeRatio() const
+{
+    return m_edgeRatio;
+}
+
+bool ImageAnalysis::prefersLossless() const
+{
+    // Smooth gradients have few colours too, but no hard edges, and they compress far
+    // better as JPEG.
+    if (m_edgeRatio < minimumEdgeRatio)
+        return false;
+    if (m_colorCount <= palettedColorCount)
+        return m_gradientEntropy < palettedGradientEntropy;
+    return m_gradientEntropy < syntheticGradientEntropy;
+}
+
+int ImageAnalysis::suggestedQuality() const
+{
+    return qBound(75, qRound(95 - 3 * m_gradientEntropy), 92);
+}
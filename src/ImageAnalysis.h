@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QImage>
+
+/**
+ * The ImageAnalysis class estimates how an image is best compressed from a subsample of
+ * its pixels. Flat areas with hard edges between them, as in line art or user interface
+ * frames, compress better losslessly, while smooth gradients and photographic content,
+ * as in night skies, compress far better as JPEG.
+ *
+ * The analysis looks at a few hundred rows of a few hundred pixels, so it takes about
+ * as long for a 6K frame as for its thumbnail.
+ */
+class Q_DECL_EXPORT ImageAnalysis
+{
+public:
+    explicit ImageAnalysis(const QImage &image);
+
+    /**
+     * Returns the number of distinct colours in the subsample. Counting stops at a few
+     * thousand colours.
+     */
+    int colorCount() const;
+
+    /**
+     * Returns the Shannon entropy of horizontal luma gradients in the subsample, in bits.
+     */
+    qreal gradientEntropy() const;
+
+    /**
+     * Returns the fraction of horizontal luma gradients in the subsample that are hard
+     * edges.
+     */
+    qreal edgeRatio() const;
+
+    /**
+     * Returns @c true if the image is expected to compress better with a lossless codec.
+     */
+    bool prefersLossless() const;
+
+    /**
+     * Returns the JPEG quality that keeps compression artifacts inconspicuous. Smooth
+     * content needs a higher quality than busy content, which masks artifacts.
+     */
+    int suggestedQuality() const;
+
+private:
+    qreal m_gradientEntropy = 0;
+    qreal m_edgeRatio = 0;
+    int m_colorCount = 0;
+};
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ImportContext.h"
+
+ImportContext::ImportContext()
+{
+}
+
+ImportContext::~ImportContext()
+{
+}
+
+void ImportContext::cancel()
+{
+    m_canceled = true;
+}
+
+bool ImportContext::isCanceled() const
+{
+    return m_canceled;
+}
+
+void ImportContext::setDeferredDecoding(bool deferred)
+{
+    m_deferredDecoding = deferred;
+}
+
+bool ImportContext::deferredDecoding() const
+{
+    return m_deferredDecoding;
+}
+
+void ImportContext::frameDecoded(int index, int count, const QImage &image)
+{
+    Q_UNUSED(index)
+    Q_UNUSED(count)
+    Q_UNUSED(image)
+}
+
+QImage ImportContext::allocateFrame(const QSize &size, QImage::Format format)
+{
+    Q_UNUSED(size)
+    Q_UNUSED(format)
+    return QImage();
+}
+
+void ImportContext::fileWritten(const QString &filePath)
+{
+    Q_UNUSED(filePath)
+}
+
+void ImportContext::entryWritten(const QString &archivePath, const QString &name)
+{
+    Q_UNUSED(archivePath)
+    Q_UNUSED(name)
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QImage>
+#include <QString>
+
+#include <atomic>
+
+/**
+ * The ImportContext class lets importers and the writer report progress and check
+ * whether the import has been canceled.
+ *
+ * Hooks may be called from worker threads.
+ */
+class Q_DECL_EXPORT ImportContext
+{
+public:
+    ImportContext();
+    virtual ~ImportContext();
+
+    /**
+     * Requests the import to be stopped as soon as possible.
+     */
+    void cancel();
+
+    /**
+     * Returns @c true if the import has been canceled.
+     */
+    bool isCanceled() const;
+
+    /**
+     * Sets whether importers may postpone decoding images until their pixel data is
+     * actually needed, e.g. when only the metadata and the preview are written.
+     *
+     * Frames that are decoded later are reported to this context, so it must stay alive
+     * as long as the loaded wallpaper.
+     */
+    void setDeferredDecoding(bool deferred);
+    bool deferredDecoding() const;
+
+    /**
+     * This method is called when the frame with the given @p index out of @p count
+     * frames has been decoded.
+     */
+    virtual void frameDecoded(int index, int count, const QImage &image);
+
+    /**
+     * Allocates a frame of the given @p size and @p format for an importer to decode
+     * into, e.g. in memory that is shared with another process. Importers that decode
+     * into buffers of their own copy the frame into it once.
+     *
+     * The default implementation returns a null image, in which case importers allocate
+     * frames as they see fit.
+     */
+    virtual QImage allocateFrame(const QSize &size, QImage::Format format);
+
+    /**
+     * This method is called when the file with the given @p filePath has been written.
+     * A packed package is reported once, when the packed file is complete.
+     */
+    virtual void fileWritten(const QString &filePath);
+
+    /**
+     * This method is called when the entry with the given package-relative @p name has
+     * been added to the packed file with the given @p archivePath. The packed file
+     * doesn't exist at that path until it's reported by fileWritten().
+     */
+    virtual void entryWritten(const QString &archivePath, const QString &name);
+
+private:
+    std::atomic<bool> m_canceled { false };
+    bool m_deferredDecoding = false;
+
+    Q_DISABLE_COPY(ImportContext)
+};
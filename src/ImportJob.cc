@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ImportJob.h"
+#include "ImportContext.h"
+#include "Loader.h"
+#include "Wallpaper.h"
+#include "Writer.h"
+
+#include <QMutexLocker>
+#include <QtConcurrent>
+
+class ImportJob::Context : public ImportContext
+{
+public:
+    explicit Context(ImportJob *job)
+        : m_job(job)
+    {
+    }
+
+    void frameDecoded(int index, int count, const QImage &image) override
+    {
+        m_job->m_frameCount = count;
+        ++m_job->m_decodedCount;
+        emit m_job->frameDecoded(index, count, image);
+        m_job->advance();
+    }
+
+    void fileWritten(const QString &filePath) override
+    {
+        emit m_job->fileWritten(filePath);
+        m_job->advance();
+    }
+
+    void entryWritten(const QString &archivePath, const QString &name) override
+    {
+        Q_UNUSED(archivePath)
+        Q_UNUSED(name)
+        m_job->advance();
+    }
+
+private:
+    ImportJob *m_job;
+};
+
+ImportJob::ImportJob(const Loader *loader, const QString &fileName, QObject *parent)
+    : QObject(parent)
+    , m_context(new Context(this))
+    , m_fileName(fileName)
+    , m_loader(loader)
+{
+    connect(&m_watcher, &QFutureWatcher<void>::finished, this, &ImportJob::finished);
+}
+
+ImportJob::~ImportJob()
+{
+    cancel();
+    waitForFinished();
+}
+
+void ImportJob::setWriter(Writer *writer, const QString &targetPath)
+{
+    m_writer = writer;
+    m_targetPath = targetPath;
+}
+
+void ImportJob::start()
+{
+    m_future = QtConcurrent::run([this]() {
+        run();
+    });
+    m_watcher.setFuture(m_future);
+}
+
+void ImportJob::cancel()
+{
+    m_context->cancel();
+}
+
+bool ImportJob::isCanceled() const
+{
+    return m_context->isCanceled();
+}
+
+bool ImportJob::isFinished() const
+{
+    return m_future.isFinished();
+}
+
+void ImportJob::waitForFinished()
+{
+    m_future.waitForFinished();
+}
+
+std::shared_ptr<Wallpaper> ImportJob::wallpaper() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_wallpaper;
+}
+
+void ImportJob::run()
+{
+    std::shared_ptr<Wallpaper> wallpaper = m_loader->load(m_fileName, m_context.get());
+    if (!wallpaper || m_context->isCanceled())
+        return;
+
+    // Importers may leave frames to be decoded on demand, e.g. frames that are copied
+    // as is, and the job's context doesn't outlive the job, so such frames are never
+    // reported. They count as decoded once the wallpaper has been loaded.
+    m_frameCount = wallpaper->imageCount();
+    const int unreportedCount = m_frameCount - m_decodedCount;
+    if (unreportedCount > 0)
+        advance(unreportedCount);
+
+    if (m_writer) {
+        m_writer->setWallpaper(wallpaper);
+        m_writer->setContext(m_context.get());
+        const bool written = m_writer->write(m_targetPath);
+        m_writer->setContext(nullptr);
+        if (!written)
+            return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_wallpaper = wallpaper;
+}
+
+void ImportJob::advance(int steps)
+{
+    // Every frame is decoded once and written to every package, plus the preview and
+    // the metadata. Packed files are reported once more when they are complete.
+    const int frameCount = m_frameCount;
+    const int filesPerOutput = m_writer && m_writer->isPacked() ? frameCount + 3 : frameCount + 2;
+    const int maximum = m_writer ? frameCount + m_writer->outputCount() * filesPerOutput : frameCount;
+    emit progressChanged(m_progress += steps, maximum);
+}
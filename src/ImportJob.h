@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QFuture>
+#include <QFutureWatcher>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+
+#include <atomic>
+#include <memory>
+
+class Loader;
+class Wallpaper;
+class Writer;
+
+/**
+ * The ImportJob class loads, and optionally writes, a dynamic wallpaper in a worker
+ * thread.
+ *
+ * Signals are emitted as the import progresses; canceling the job stops in-flight
+ * decoding as soon as possible.
+ */
+class Q_DECL_EXPORT ImportJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructs an import job for the dynamic wallpaper with the given @p fileName.
+     * The @p loader must outlive the job.
+     */
+    ImportJob(const Loader *loader, const QString &fileName, QObject *parent = nullptr);
+
+    /**
+     * Destroys the import job. If the job is still running, it's canceled and waited for.
+     */
+    ~ImportJob() override;
+
+    /**
+     * Sets the @p writer that should write the dynamic wallpaper to @p targetPath once
+     * it's loaded. The writer must outlive the job.
+     */
+    void setWriter(Writer *writer, const QString &targetPath = QString());
+
+    /**
+     * Starts the import job.
+     */
+    void start();
+
+    /**
+     * Cancels the import job.
+     */
+    void cancel();
+
+    bool isCanceled() const;
+    bool isFinished() const;
+
+    /**
+     * Blocks until the import job is finished.
+     */
+    void waitForFinished();
+
+    /**
+     * Returns the loaded dynamic wallpaper, or @c null if the job hasn't finished yet or
+     * it has failed. If a writer has been set, a wallpaper that could not be written
+     * counts as a failure.
+     */
+    std::shared_ptr<Wallpaper> wallpaper() const;
+
+Q_SIGNALS:
+    /**
+     * This signal is emitted when the frame with the given @p index has been decoded.
+     */
+    void frameDecoded(int index, int count, const QImage &image);
+
+    /**
+     * This signal is emitted when the file with the given @p filePath has been written.
+     */
+    void fileWritten(const QString &filePath);
+
+    /**
+     * This signal is emitted when the import has progressed. @p maximum is 0 until the
+     * number of frames is known.
+     */
+    void progressChanged(int value, int maximum);
+
+    /**
+     * This signal is emitted when the import job is finished, either successfully or not.
+     */
+    void finished();
+
+private:
+    class Context;
+
+    void run();
+    void advance(int steps = 1);
+
+    std::unique_ptr<Context> m_context;
+    std::shared_ptr<Wallpaper> m_wallpaper;
+    QFuture<void> m_future;
+    QFutureWatcher<void> m_watcher;
+    QString m_fileName;
+    QString m_targetPath;
+    mutable QMutex m_mutex;
+    const Loader *m_loader;
+    Writer *m_writer = nullptr;
+    std::atomic<int> m_frameCount { 0 };
+    std::atomic<int> m_decodedCount { 0 };
+    std::atomic<int> m_progress { 0 };
+
+    Q_DISABLE_COPY(ImportJob)
+};
@@ -17,6 +17,7 @@
  */
 
 #include "Importer.h"
+#include "Wallpaper.h"
 
 Importer::Importer(QObject *parent)
     : QObject(parent)
@@ -26,3 +27,9 @@ Importer::Importer(QObject *parent)
 Importer::~Importer()
 {
 }
+
+std::unique_ptr<Wallpaper> Importer::load(const QString &fileName, ImportContext *context) const
+{
+    Q_UNUSED(context)
+    return load(fileName);
+}
@@ -23,6 +23,7 @@
 
 #include <memory>
 
+class ImportContext;
 class Wallpaper;
 
 class Q_DECL_EXPORT Importer : public QObject
@@ -40,6 +41,14 @@ public:
      */
     virtual std::unique_ptr<Wallpaper> load(const QString &fileName) const = 0;
 
+    /**
+     * Attempts to load a dynamic wallpaper with the given @p fileName, reporting progress
+     * to the given @p context.
+     *
+     * The default implementation ignores the @p context and calls load().
+     */
+    virtual std::unique_ptr<Wallpaper> load(const QString &fileName, ImportContext *context) const;
+
 private:
     Q_DISABLE_COPY(Importer)
 };
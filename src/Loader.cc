@@ -17,7 +17,9 @@
  */
 
 #include "Loader.h"
+#include "ImportJob.h"
 #include "Importer.h"
+#include "Profiler.h"
 #include "Wallpaper.h"
 
 #include <QCoreApplication>
@@ -43,10 +45,29 @@ static QStringList discoverCandidates()
     return candidates;
 }
 
-static QVector<Importer *> discoverImporters()
+static QVector<Importer *> staticImporters()
 {
     QVector<Importer *> importers;
 
+    const QObjectList instances = QPluginLoader::staticInstances();
+    for (QObject *instance : instances) {
+        if (Importer *importer = qobject_cast<Importer *>(instance))
+            importers << importer;
+    }
+
+    return importers;
+}
+
+static QVector<Importer *> discoverImporters()
+{
+    ProfileScope scope(Profiler::Discovery);
+
+    // Importers that are linked into the application are used instead of loadable ones,
+    // so plugin directories need not be scanned nor modules loaded on every start.
+    QVector<Importer *> importers = staticImporters();
+    if (!importers.isEmpty())
+        return importers;
+
     const QStringList candidates = discoverCandidates();
     for (const QString &candidate : candidates) {
         if (!QLibrary::isLibrary(candidate))
@@ -69,16 +90,21 @@ Loader::~Loader()
 {
 }
 
-std::unique_ptr<Wallpaper> Loader::load(const QString &fileName) const
+std::unique_ptr<Wallpaper> Loader::load(const QString &fileName, ImportContext *context) const
 {
     if (m_importers.isEmpty())
         qWarning() << "No importer plugins have been found";
 
     for (Importer *importer : m_importers) {
-        std::unique_ptr<Wallpaper> wallpaper = importer->load(fileName);
+        std::unique_ptr<Wallpaper> wallpaper = importer->load(fileName, context);
         if (wallpaper)
             return wallpaper;
     }
 
     return nullptr;
 }
+
+ImportJob *Loader::loadAsync(const QString &fileName, QObject *parent) const
+{
+    return new ImportJob(this, fileName, parent);
+}
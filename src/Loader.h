@@ -23,6 +23,8 @@
 
 #include <memory>
 
+class ImportContext;
+class ImportJob;
 class Importer;
 class Wallpaper;
 
@@ -31,10 +33,28 @@ class Q_DECL_EXPORT Loader : public QObject
     Q_OBJECT
 
 public:
+    /**
+     * Constructs a loader with the importers that are linked into the application as
+     * static Qt plugins or, if there are none, with the importer plugins that are found
+     * in the library paths.
+     */
     explicit Loader(QObject *parent = nullptr);
     ~Loader() override;
 
-    std::unique_ptr<Wallpaper> load(const QString &fileName) const;
+    /**
+     * Loads the dynamic wallpaper with the given @p fileName. If a @p context is
+     * specified, progress is reported to it.
+     */
+    std::unique_ptr<Wallpaper> load(const QString &fileName, ImportContext *context = nullptr) const;
+
+    /**
+     * Creates a job that loads the dynamic wallpaper with the given @p fileName in a
+     * worker thread. The job doesn't run until ImportJob::start() is called, so signals
+     * can be connected first.
+     *
+     * The caller takes the ownership of the returned job, unless a @p parent is specified.
+     */
+    ImportJob *loadAsync(const QString &fileName, QObject *parent = nullptr) const;
 
 private:
     QVector<Importer *> m_importers;
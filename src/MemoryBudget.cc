@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "MemoryBudget.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+#include <algorithm>
+
+MemoryBudget::Reclaimer::~Reclaimer()
+{
+}
+
+MemoryBudget *MemoryBudget::self()
+{
+    static MemoryBudget budget;
+    return &budget;
+}
+
+void MemoryBudget::setLimit(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_limit = bytes;
+    m_condition.wakeAll();
+}
+
+qint64 MemoryBudget::limit() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_limit;
+}
+
+bool MemoryBudget::isLimited() const
+{
+    return limit() > 0;
+}
+
+qint64 MemoryBudget::usage() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_usage;
+}
+
+qint64 MemoryBudget::peakUsage() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_peakUsage;
+}
+
+bool MemoryBudget::canWait() const
+{
+    // Waiting makes sense only if some other thread holds memory and is not waiting
+    // itself, otherwise nobody would ever wake us up.
+    const Qt::HANDLE currentThread = QThread::currentThreadId();
+    for (auto it = m_holds.constBegin(); it != m_holds.constEnd(); ++it) {
+        if (it.value() != currentThread && !m_waiters.contains(it.value()))
+            return true;
+    }
+    return false;
+}
+
+bool MemoryBudget::acquire(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+
+    if (m_limit && bytes > m_limit)
+        return false;
+
+    while (m_limit && m_usage + bytes > m_limit) {
+        const qint64 shortfall = m_usage + bytes - m_limit;
+
+        locker.unlock();
+        const qint64 reclaimed = reclaim(shortfall);
+        locker.relock();
+
+        if (reclaimed > 0 || !m_limit || m_usage + bytes <= m_limit)
+            continue;
+        if (!canWait())
+            return false;
+
+        const Qt::HANDLE currentThread = QThread::currentThreadId();
+        ++m_waiters[currentThread];
+        m_condition.wait(&m_mutex);
+        if (!--m_waiters[currentThread])
+            m_waiters.remove(currentThread);
+    }
+
+    m_usage += bytes;
+    m_peakUsage = std::max(m_peakUsage, m_usage);
+
+    return true;
+}
+
+bool MemoryBudget::tryAcquire(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_limit && m_usage + bytes > m_limit)
+        return false;
+
+    m_usage += bytes;
+    m_peakUsage = std::max(m_peakUsage, m_usage);
+
+    return true;
+}
+
+void MemoryBudget::forceAcquire(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_usage += bytes;
+    m_peakUsage = std::max(m_peakUsage, m_usage);
+}
+
+void MemoryBudget::release(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_usage -= bytes;
+    m_condition.wakeAll();
+}
+
+quint64 MemoryBudget::hold()
+{
+    QMutexLocker locker(&m_mutex);
+    const quint64 hold = m_nextHold++;
+    m_holds.insert(hold, QThread::currentThreadId());
+    return hold;
+}
+
+void MemoryBudget::unhold(quint64 hold)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_holds.remove(hold))
+        m_condition.wakeAll();
+}
+
+void MemoryBudget::wait(QWaitCondition *condition, QMutex *mutex)
+{
+    const Qt::HANDLE currentThread = QThread::currentThreadId();
+
+    // Threads that wait for memory held by this thread must not wait forever.
+    {
+        QMutexLocker locker(&m_mutex);
+        ++m_waiters[currentThread];
+        m_condition.wakeAll();
+    }
+
+    condition->wait(mutex);
+
+    QMutexLocker locker(&m_mutex);
+    if (!--m_waiters[currentThread])
+        m_waiters.remove(currentThread);
+}
+
+void MemoryBudget::addReclaimer(Reclaimer *reclaimer, bool preferred)
+{
+    QMutexLocker locker(&m_reclaimMutex);
+    if (preferred)
+        m_reclaimers.prepend(reclaimer);
+    else
+        m_reclaimers.append(reclaimer);
+}
+
+void MemoryBudget::removeReclaimer(Reclaimer *reclaimer)
+{
+    QMutexLocker locker(&m_reclaimMutex);
+    m_reclaimers.removeOne(reclaimer);
+}
+
+qint64 MemoryBudget::reclaim(qint64 bytes)
+{
+    QMutexLocker locker(&m_reclaimMutex);
+
+    qint64 reclaimed = 0;
+    for (Reclaimer *reclaimer : qAsConst(m_reclaimers)) {
+        reclaimed += reclaimer->reclaim(bytes - reclaimed);
+        if (reclaimed >= bytes)
+            break;
+    }
+
+    return reclaimed;
+}
+
+MemoryReservation::MemoryReservation(qint64 bytes, MemoryBudget *budget)
+    : m_budget(budget)
+    , m_bytes(bytes)
+    , m_valid(budget->acquire(bytes))
+{
+    if (m_valid)
+        m_hold = m_budget->hold();
+}
+
+MemoryReservation::~MemoryReservation()
+{
+    if (!m_valid)
+        return;
+    if (m_bytes)
+        m_budget->release(m_bytes);
+    m_budget->unhold(m_hold);
+}
+
+bool MemoryReservation::isValid() const
+{
+    return m_valid;
+}
+
+void MemoryReservation::release(qint64 bytes)
+{
+    m_budget->release(bytes);
+    m_bytes -= bytes;
+}
+
+void MemoryReservation::transfer(qint64 bytes)
+{
+    m_bytes -= bytes;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QHash>
+#include <QMutex>
+#include <QVector>
+#include <QWaitCondition>
+
+/**
+ * The MemoryBudget class bounds the amount of decoded pixel data held by the import
+ * pipeline.
+ *
+ * Memory is charged to the budget with acquire() and returned with release(). If an
+ * allocation doesn't fit, the budget first asks registered reclaimers, e.g. frame stores,
+ * to free memory by spilling frames to the disk. If nothing can be reclaimed, the
+ * calling thread waits until other threads release memory they hold. If no other thread
+ * can make progress, the allocation fails, so the limit is never exceeded.
+ *
+ * A budget without a limit accepts every allocation immediately.
+ */
+class Q_DECL_EXPORT MemoryBudget
+{
+public:
+    class Q_DECL_EXPORT Reclaimer
+    {
+    public:
+        virtual ~Reclaimer();
+
+        /**
+         * Attempts to free at least @p bytes of memory charged to the budget. Returns the
+         * number of bytes that have been actually released.
+         */
+        virtual qint64 reclaim(qint64 bytes) = 0;
+    };
+
+    static MemoryBudget *self();
+
+    /**
+     * Sets the maximum amount of memory, in bytes. 0 means that the budget is unlimited.
+     */
+    void setLimit(qint64 bytes);
+    qint64 limit() const;
+    bool isLimited() const;
+
+    /**
+     * Returns the amount of memory currently charged to the budget.
+     */
+    qint64 usage() const;
+
+    /**
+     * Returns the largest amount of memory that has been charged to the budget.
+     */
+    qint64 peakUsage() const;
+
+    /**
+     * Charges @p bytes to the budget, blocking until enough memory is available. Returns
+     * @c false if the allocation can never be satisfied.
+     */
+    bool acquire(qint64 bytes);
+
+    /**
+     * Charges @p bytes to the budget if they fit right away. Unlike acquire(), this
+     * neither waits nor reclaims memory.
+     */
+    bool tryAcquire(qint64 bytes);
+
+    /**
+     * Charges @p bytes to the budget even if they exceed the limit. This is meant for
+     * memory that is already allocated and cannot be given up, so usage stays accurate.
+     */
+    void forceAcquire(qint64 bytes);
+
+    /**
+     * Returns @p bytes to the budget.
+     */
+    void release(qint64 bytes);
+
+    /**
+     * Marks memory that is going to be released eventually, e.g. a frame that is being
+     * encoded, as held by the calling thread. Other threads wait for held memory rather
+     * than failing their allocations, unless the holding thread is waiting itself.
+     *
+     * Returns a handle that must be passed to unhold() once the memory is released,
+     * possibly on another thread.
+     */
+    quint64 hold();
+    void unhold(quint64 hold);
+
+    /**
+     * Waits on the given @p condition, like QWaitCondition::wait(), with the calling
+     * thread marked as waiting, so other threads don't wait for the memory it holds.
+     */
+    void wait(QWaitCondition *condition, QMutex *mutex);
+
+    /**
+     * Registers the given @p reclaimer. Preferred reclaimers, e.g. caches that can free
+     * memory without any I/O, are asked first.
+     */
+    void addReclaimer(Reclaimer *reclaimer, bool preferred = false);
+    void removeReclaimer(Reclaimer *reclaimer);
+
+private:
+    qint64 reclaim(qint64 bytes);
+    bool canWait() const;
+
+    QHash<quint64, Qt::HANDLE> m_holds;
+    QHash<Qt::HANDLE, int> m_waiters;
+    QVector<Reclaimer *> m_reclaimers;
+    mutable QMutex m_mutex;
+    QMutex m_reclaimMutex;
+    QWaitCondition m_condition;
+    qint64 m_limit = 0;
+    qint64 m_usage = 0;
+    qint64 m_peakUsage = 0;
+    quint64 m_nextHold = 1;
+};
+
+/**
+ * The MemoryReservation class is a convenience wrapper that acquires memory from the
+ * budget and returns whatever is left of it when it goes out of scope.
+ */
+class Q_DECL_EXPORT MemoryReservation
+{
+public:
+    explicit MemoryReservation(qint64 bytes, MemoryBudget *budget = MemoryBudget::self());
+    ~MemoryReservation();
+
+    /**
+     * Returns @c true if the memory has been successfully acquired.
+     */
+    bool isValid() const;
+
+    /**
+     * Returns @p bytes of the reservation to the budget.
+     */
+    void release(qint64 bytes);
+
+    /**
+     * Hands @p bytes of the reservation over to another owner, which becomes responsible
+     * for returning them to the budget.
+     */
+    void transfer(qint64 bytes);
+
+private:
+    MemoryBudget *m_budget;
+    qint64 m_bytes;
+    quint64 m_hold = 0;
+    bool m_valid;
+
+    Q_DISABLE_COPY(MemoryReservation)
+};
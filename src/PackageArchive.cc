@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PackageArchive.h"
+#include "Profiler.h"
+
+#include <QMutexLocker>
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <unistd.h>
+
+// The layout of a packed package, all integers are little-endian:
+//
+//   header   magic (8 bytes), version (u32), page size (u32), padded to a page
+//   entries  the data of every entry, each starting at a page boundary
+//   index    for every entry: offset (u64), size (u64), name length (u32), UTF-8 name
+//   footer   index offset (u64), entry count (u32), reserved (u32), magic (8 bytes)
+//
+// The page size is that of the writing host. Readers accept any power of two within
+// the bounds below, so files can be shared between hosts with different page sizes.
+static const char packageMagic[8] = { 'D', 'W', 'P', 'A', 'C', 'K', '\0', '\1' };
+static const quint32 packageVersion = 1;
+static const quint64 minimumPageSize = 4096;
+static const quint64 maximumPageSize = 1024 * 1024;
+static const quint64 headerSize = 16;
+static const quint64 footerSize = 24;
+static const quint64 indexEntrySize = 20;
+
+template<typename T>
+static void appendLittleEndian(QByteArray *buffer, T value)
+{
+    const T littleEndianValue = qToLittleEndian(value);
+    buffer->append(reinterpret_cast<const char *>(&littleEndianValue), sizeof(T));
+}
+
+PackageArchiveWriter::PackageArchiveWriter(const QString &fileName)
+    : m_file(fileName)
+    , m_pageSize(std::max<quint64>(sysconf(_SC_PAGESIZE), minimumPageSize))
+{
+}
+
+QString PackageArchiveWriter::fileName() const
+{
+    return m_file.fileName();
+}
+
+bool PackageArchiveWriter::open()
+{
+    if (!m_file.open(QIODevice::WriteOnly))
+        return false;
+
+    QByteArray header;
+    header.append(packageMagic, sizeof(packageMagic));
+    appendLittleEndian<quint32>(&header, packageVersion);
+    appendLittleEndian<quint32>(&header, m_pageSize);
+
+    if (m_file.write(header) != header.size())
+        return false;
+    m_offset = header.size();
+
+    return true;
+}
+
+bool PackageArchiveWriter::pad()
+{
+    static const char zeroes[minimumPageSize] = {};
+
+    quint64 padding = (m_pageSize - m_offset % m_pageSize) % m_pageSize;
+    while (padding) {
+        const quint64 chunkSize = std::min(padding, minimumPageSize);
+        if (m_file.write(zeroes, chunkSize) != qint64(chunkSize))
+            return false;
+        m_offset += chunkSize;
+        padding -= chunkSize;
+    }
+
+    return true;
+}
+
+bool PackageArchiveWriter::add(const QString &name, const QByteArray &data)
+{
+    ProfileScope scope(Profiler::Write);
+
+    QMutexLocker locker(&m_mutex);
+    if (m_failed)
+        return false;
+
+    if (!pad() || m_file.write(data) != data.size()) {
+        m_failed = true;
+        return false;
+    }
+
+    m_entries.append({ name.toUtf8(), m_offset, quint64(data.size()) });
+    m_offset += data.size();
+
+    scope.addBytesWritten(data.size());
+
+    return true;
+}
+
+bool PackageArchiveWriter::commit()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_failed) {
+        m_file.cancelWriting();
+        return false;
+    }
+
+    const quint64 indexOffset = m_offset;
+
+    QByteArray trailer;
+    for (const Entry &entry : qAsConst(m_entries)) {
+        appendLittleEndian<quint64>(&trailer, entry.offset);
+        appendLittleEndian<quint64>(&trailer, entry.size);
+        appendLittleEndian<quint32>(&trailer, entry.name.size());
+        trailer.append(entry.name);
+    }
+
+    appendLittleEndian<quint64>(&trailer, indexOffset);
+    appendLittleEndian<quint32>(&trailer, m_entries.count());
+    appendLittleEndian<quint32>(&trailer, 0);
+    trailer.append(packageMagic, sizeof(packageMagic));
+
+    if (m_file.write(trailer) != trailer.size()) {
+        m_file.cancelWriting();
+        return false;
+    }
+
+    return m_file.commit();
+}
+
+PackageArchive::PackageArchive(const QString &fileName)
+    : m_file(fileName)
+{
+}
+
+bool PackageArchive::open()
+{
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+
+    m_size = m_file.size();
+    if (m_size < headerSize + footerSize)
+        return false;
+
+    m_data = m_file.map(0, m_size);
+    if (!m_data)
+        return false;
+
+    if (std::memcmp(m_data, packageMagic, sizeof(packageMagic)))
+        return false;
+    if (qFromLittleEndian<quint32>(m_data + 8) != packageVersion)
+        return false;
+
+    const quint64 pageSize = qFromLittleEndian<quint32>(m_data + 12);
+    if (pageSize < minimumPageSize || pageSize > maximumPageSize || (pageSize & (pageSize - 1)))
+        return false;
+
+    const uchar *footer = m_data + m_size - footerSize;
+    if (std::memcmp(footer + 16, packageMagic, sizeof(packageMagic)))
+        return false;
+
+    const quint64 indexOffset = qFromLittleEndian<quint64>(footer);
+    const quint32 entryCount = qFromLittleEndian<quint32>(footer + 8);
+    if (indexOffset < headerSize || indexOffset > m_size - footerSize)
+        return false;
+    if (entryCount > (m_size - footerSize - indexOffset) / indexEntrySize)
+        return false;
+
+    // Entries must lie between the header and the index, at page-aligned offsets, so
+    // the data handed out never reaches past the end of the mapping.
+    const uchar *cursor = m_data + indexOffset;
+    for (quint32 i = 0; i < entryCount; ++i) {
+        if (quint64(footer - cursor) < indexEntrySize)
+            return false;
+
+        const quint64 offset = qFromLittleEndian<quint64>(cursor);
+        const quint64 size = qFromLittleEndian<quint64>(cursor + 8);
+        const quint32 nameLength = qFromLittleEndian<quint32>(cursor + 16);
+        cursor += indexEntrySize;
+
+        if (quint64(footer - cursor) < nameLength)
+            return false;
+        if (offset < headerSize || offset % pageSize)
+            return false;
+        if (offset > indexOffset || size > indexOffset - offset)
+            return false;
+        // Entries are handed out as byte arrays, whose size is an int.
+        if (size > quint64(std::numeric_limits<int>::max()))
+            return false;
+
+        const QString name = QString::fromUtf8(reinterpret_cast<const char *>(cursor), nameLength);
+        cursor += nameLength;
+
+        if (m_entries.contains(name))
+            return false;
+
+        m_names.append(name);
+        m_entries.insert(name, { offset, size });
+    }
+
+    return cursor == footer;
+}
+
+QStringList PackageArchive::entries() const
+{
+    return m_names;
+}
+
+bool PackageArchive::contains(const QString &name) const
+{
+    return m_entries.contains(name);
+}
+
+QByteArray PackageArchive::entry(const QString &name) const
+{
+    const auto it = m_entries.constFind(name);
+    if (it == m_entries.constEnd())
+        return QByteArray();
+
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(m_data + it->offset), it->size);
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+/**
+ * The PackageArchiveWriter class writes a wallpaper package as a single packed file.
+ *
+ * Entries are stored uncompressed, each at an offset aligned to the page size of the
+ * host, but at least 4096 bytes, so a reader can map the file and hand out the encoded
+ * bytes of an entry without copying them. The alignment is recorded in the file. The file
+ * is written sequentially in a single pass: a header, the entries in the order they
+ * are added, the index and a fixed-size footer that points at the index.
+ */
+class Q_DECL_EXPORT PackageArchiveWriter
+{
+public:
+    explicit PackageArchiveWriter(const QString &fileName);
+
+    /**
+     * Returns the path of the packed file.
+     */
+    QString fileName() const;
+
+    /**
+     * Starts writing the packed file. Nothing is visible at the final path until the
+     * file is committed.
+     */
+    bool open();
+
+    /**
+     * Appends an entry with the given package-relative @p name and @p data. This method
+     * is thread-safe.
+     */
+    bool add(const QString &name, const QByteArray &data);
+
+    /**
+     * Writes the index and atomically replaces the file at the final path.
+     */
+    bool commit();
+
+private:
+    struct Entry
+    {
+        QByteArray name;
+        quint64 offset;
+        quint64 size;
+    };
+
+    bool pad();
+
+    QSaveFile m_file;
+    QVector<Entry> m_entries;
+    quint64 m_pageSize;
+    quint64 m_offset = 0;
+    bool m_failed = false;
+    QMutex m_mutex;
+};
+
+/**
+ * The PackageArchive class provides read access to a packed wallpaper package.
+ *
+ * The file is memory-mapped, so the data of entries is paged in lazily by the kernel
+ * and shared with every other process that maps the same file.
+ */
+class Q_DECL_EXPORT PackageArchive
+{
+public:
+    explicit PackageArchive(const QString &fileName);
+
+    /**
+     * Maps the packed file and reads its index. Returns @c false if the file is not a
+     * valid packed package, e.g. if an entry is not aligned as recorded in the header,
+     * it doesn't lie between the header and the index or it's larger than 2 GiB.
+     */
+    bool open();
+
+    /**
+     * Returns the package-relative names of all entries, in the order they were written.
+     */
+    QStringList entries() const;
+
+    /**
+     * Returns @c true if the package contains an entry with the given @p name.
+     */
+    bool contains(const QString &name) const;
+
+    /**
+     * Returns the data of the entry with the given @p name without copying it. The
+     * returned byte array refers to the mapped file and must not outlive the archive.
+     */
+    QByteArray entry(const QString &name) const;
+
+private:
+    struct Entry
+    {
+        quint64 offset;
+        quint64 size;
+    };
+
+    QFile m_file;
+    const uchar *m_data = nullptr;
+    quint64 m_size = 0;
+    QStringList m_names;
+    QHash<QString, Entry> m_entries;
+};
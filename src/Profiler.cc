@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "Profiler.h"
+#include "BufferPool.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QTextStream>
+#include <QThread>
+
+#include <algorithm>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+std::atomic<bool> Profiler::s_enabled { false };
+
+static QLatin1String stageName(Profiler::Stage stage)
+{
+    switch (stage) {
+    case Profiler::Startup:
+        return QLatin1String("startup");
+    case Profiler::Discovery:
+        return QLatin1String("discovery");
+    case Profiler::Read:
+        return QLatin1String("read");
+    case Profiler::MetaData:
+        return QLatin1String("metadata");
+    case Profiler::Decode:
+        return QLatin1String("decode");
+    case Profiler::Encode:
+        return QLatin1String("encode");
+    case Profiler::Write:
+        return QLatin1String("write");
+    default:
+        Q_UNREACHABLE();
+        return QLatin1String();
+    }
+}
+
+static qint64 threadCpuTime()
+{
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static qint64 processCpuTime()
+{
+    timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static qint64 processAge()
+{
+    QFile file(QStringLiteral("/proc/self/stat"));
+    if (!file.open(QIODevice::ReadOnly))
+        return 0;
+    const QByteArray stat = file.readAll();
+
+    // The command name may contain spaces, so fields are counted from its closing
+    // parenthesis. The start time is the 22nd field and the state, the 3rd one.
+    const int commandEnd = stat.lastIndexOf(')');
+    if (commandEnd == -1)
+        return 0;
+    const QList<QByteArray> fields = stat.mid(commandEnd + 2).split(' ');
+    if (fields.count() < 20)
+        return 0;
+
+    bool ok = false;
+    const qint64 startTicks = fields.at(19).toLongLong(&ok);
+    const qint64 ticksPerSecond = sysconf(_SC_CLK_TCK);
+    if (!ok || ticksPerSecond <= 0)
+        return 0;
+
+    timespec now;
+    if (clock_gettime(CLOCK_BOOTTIME, &now) != 0)
+        return 0;
+
+    const qint64 startTime = startTicks / ticksPerSecond * 1000000000
+        + startTicks % ticksPerSecond * 1000000000 / ticksPerSecond;
+    return std::max<qint64>(0, qint64(now.tv_sec) * 1000000000 + now.tv_nsec - startTime);
+}
+
+static qint64 peakResidentMemory()
+{
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return qint64(usage.ru_maxrss) * 1024;
+}
+
+static qint64 residentMemory()
+{
+    // The file is read at every stage boundary, so it's kept open.
+    static const int fd = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+
+    // The second field is the number of resident pages.
+    char buffer[128];
+    const ssize_t size = ::pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (size <= 0)
+        return 0;
+    buffer[size] = '\0';
+
+    unsigned long long pageCount = 0;
+    if (std::sscanf(buffer, "%*s %llu", &pageCount) != 1)
+        return 0;
+
+    return qint64(pageCount) * sysconf(_SC_PAGESIZE);
+}
+
+Profiler::Profiler()
+{
+    m_clock.start();
+}
+
+Profiler *Profiler::self()
+{
+    static Profiler profiler;
+    return &profiler;
+}
+
+void Profiler::setTraceEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    m_traceEnabled = enabled;
+    s_enabled = m_traceEnabled || m_statisticsEnabled;
+}
+
+void Profiler::setStatisticsEnabled(bool enabled)
+{
+    QMutexLocker locker(&m_mutex);
+    m_statisticsEnabled = enabled;
+    s_enabled = m_traceEnabled || m_statisticsEnabled;
+}
+
+qint64 Profiler::timestamp() const
+{
+    return m_clock.nsecsElapsed();
+}
+
+void Profiler::record(Stage stage, int index, qint64 start, qint64 wallTime, qint64 cpuTime, qint64 residentMemory)
+{
+    Counters &counters = m_counters[stage];
+    counters.wallTime += wallTime;
+    counters.cpuTime += cpuTime;
+
+    qint64 previousMaximum = counters.maximumResidentMemory.load();
+    while (previousMaximum < residentMemory && !counters.maximumResidentMemory.compare_exchange_weak(previousMaximum, residentMemory))
+        ;
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_traceEnabled)
+        return;
+
+    const Qt::HANDLE thread = QThread::currentThreadId();
+    auto it = m_threadIds.find(thread);
+    if (it == m_threadIds.end())
+        it = m_threadIds.insert(thread, m_threadIds.count() + 1);
+
+    Event event;
+    event.start = start;
+    event.duration = wallTime;
+    event.threadId = *it;
+    event.index = index;
+    event.stage = stage;
+    m_events << event;
+}
+
+void Profiler::recordStartup()
+{
+    if (!isEnabled())
+        return;
+
+    // The profiler clock starts after the process, so the event starts before zero.
+    const qint64 wallTime = processAge();
+    record(Startup, -1, timestamp() - wallTime, wallTime, processCpuTime(), residentMemory());
+}
+
+bool Profiler::writeTrace(const QString &fileName) const
+{
+    QJsonArray traceEvents;
+
+    QMutexLocker locker(&m_mutex);
+    for (const Event &event : m_events) {
+        QJsonObject eventObject;
+        eventObject[QLatin1String("name")] = stageName(event.stage);
+        eventObject[QLatin1String("cat")] = QLatin1String("import");
+        eventObject[QLatin1String("ph")] = QLatin1String("X");
+        eventObject[QLatin1String("ts")] = event.start / 1000.0;
+        eventObject[QLatin1String("dur")] = event.duration / 1000.0;
+        eventObject[QLatin1String("pid")] = QCoreApplication::applicationPid();
+        eventObject[QLatin1String("tid")] = event.threadId;
+        if (event.index != -1) {
+            QJsonObject argsObject;
+            argsObject[QLatin1String("frame")] = event.index;
+            eventObject[QLatin1String("args")] = argsObject;
+        }
+        traceEvents.append(eventObject);
+    }
+    locker.unlock();
+
+    QJsonObject root;
+    root[QLatin1String("traceEvents")] = traceEvents;
+    root[QLatin1String("displayTimeUnit")] = QLatin1String("ms");
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    return file.write(QJsonDocument(root).toJson(QJsonDocument::Compact)) != -1;
+}
+
+void Profiler::printStatistics(const QString &title) const
+{
+    QTextStream stream(stderr);
+
+    if (!title.isEmpty())
+        stream << title << ":" << endl;
+
+    stream << qSetFieldWidth(12) << left << "stage" << right
+           << "wall (ms)" << "cpu (ms)" << "read (KiB)" << "written (KiB)" << "frames" << "max rss (MiB)"
+           << qSetFieldWidth(0) << endl;
+
+    for (int i = 0; i < StageCount; ++i) {
+        const Counters &counters = m_counters[i];
+        stream << qSetFieldWidth(12) << left << stageName(Stage(i)) << right
+               << QString::number(counters.wallTime / 1e6, 'f', 1)
+               << QString::number(counters.cpuTime / 1e6, 'f', 1)
+               << counters.bytesRead / 1024
+               << counters.bytesWritten / 1024
+               << counters.frames.load()
+               << QString::number(counters.maximumResidentMemory / 1048576.0, 'f', 1)
+               << qSetFieldWidth(0) << endl;
+    }
+
+    stream << "total wall time: " << QString::number(timestamp() / 1e6, 'f', 1) << " ms, "
+           << "process peak rss: " << QString::number(peakResidentMemory() / 1048576.0, 'f', 1) << " MiB" << endl;
+
+    const BufferPool::Statistics poolStatistics = BufferPool::self()->statistics();
+    stream << "buffer pool: " << poolStatistics.hits << " hits, " << poolStatistics.misses << " misses, "
+           << "peak " << QString::number(poolStatistics.peakBytes / 1048576.0, 'f', 1) << " MiB, "
+           << "idle " << QString::number(poolStatistics.bytesIdle / 1048576.0, 'f', 1) << " MiB" << endl;
+}
+
+ProfileScope::ProfileScope(Profiler::Stage stage, int index)
+    : m_index(index)
+    , m_stage(stage)
+    , m_active(Profiler::isEnabled())
+{
+    if (!m_active)
+        return;
+    m_start = Profiler::self()->timestamp();
+    m_cpuStart = threadCpuTime();
+    m_residentMemoryStart = residentMemory();
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (!m_active)
+        return;
+    Profiler *profiler = Profiler::self();
+    const qint64 wallTime = profiler->timestamp() - m_start;
+    const qint64 cpuTime = threadCpuTime() - m_cpuStart;
+    profiler->record(m_stage, m_index, m_start, wallTime, cpuTime, std::max(m_residentMemoryStart, residentMemory()));
+}
+
+void ProfileScope::addBytesRead(qint64 bytes)
+{
+    if (m_active)
+        Profiler::self()->m_counters[m_stage].bytesRead += bytes;
+}
+
+void ProfileScope::addBytesWritten(qint64 bytes)
+{
+    if (m_active)
+        Profiler::self()->m_counters[m_stage].bytesWritten += bytes;
+}
+
+void ProfileScope::addFrames(int count)
+{
+    if (m_active)
+        Profiler::self()->m_counters[m_stage].frames += count;
+}
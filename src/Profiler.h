@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+
+/**
+ * The Profiler class collects per-stage timings and counters of the import pipeline.
+ *
+ * The profiler is disabled by default. While it is disabled, ProfileScope objects do
+ * nothing but check a single flag.
+ */
+class Q_DECL_EXPORT Profiler
+{
+public:
+    /**
+     * This enum type is used to specify the stage of the import pipeline.
+     */
+    enum Stage {
+        /**
+         * Starting the process up, from its execution until it's ready to import. This
+         * includes loading shared libraries and discovering importers.
+         */
+        Startup,
+        /**
+         * Looking up and loading importer plugins.
+         */
+        Discovery,
+        /**
+         * Reading and parsing the container of the source file.
+         */
+        Read,
+        /**
+         * Parsing XMP and property list metadata.
+         */
+        MetaData,
+        /**
+         * Decoding frames.
+         */
+        Decode,
+        /**
+         * Encoding frames and the preview.
+         */
+        Encode,
+        /**
+         * Writing files to the disk.
+         */
+        Write,
+        StageCount,
+    };
+
+    static Profiler *self();
+
+    /**
+     * Returns @c true if either tracing or statistics are enabled.
+     */
+    static bool isEnabled()
+    {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Sets whether trace events should be recorded.
+     */
+    void setTraceEnabled(bool enabled);
+
+    /**
+     * Sets whether per-stage statistics should be collected.
+     */
+    void setStatisticsEnabled(bool enabled);
+
+    /**
+     * Records the time since the process has been executed as the startup stage. This
+     * should be called once the application is ready to import. The start of the process
+     * is only known to the resolution of the kernel clock tick, typically 10 ms.
+     */
+    void recordStartup();
+
+    /**
+     * Writes recorded trace events to the file with the given @p fileName in the Chrome
+     * trace event format.
+     */
+    bool writeTrace(const QString &fileName) const;
+
+    /**
+     * Prints the per-stage summary to the standard error output, headed by the given
+     * @p title if it's not empty.
+     *
+     * The resident memory of a stage is the largest one sampled when the stage starts
+     * or ends, while the process peak covers the whole run.
+     */
+    void printStatistics(const QString &title = QString()) const;
+
+private:
+    Profiler();
+
+    struct Event
+    {
+        qint64 start;
+        qint64 duration;
+        qint64 threadId;
+        int index;
+        Stage stage;
+    };
+
+    struct Counters
+    {
+        std::atomic<qint64> wallTime { 0 };
+        std::atomic<qint64> cpuTime { 0 };
+        std::atomic<qint64> bytesRead { 0 };
+        std::atomic<qint64> bytesWritten { 0 };
+        std::atomic<qint64> frames { 0 };
+        std::atomic<qint64> maximumResidentMemory { 0 };
+    };
+
+    qint64 timestamp() const;
+    void record(Stage stage, int index, qint64 start, qint64 wallTime, qint64 cpuTime, qint64 residentMemory);
+
+    static std::atomic<bool> s_enabled;
+
+    QElapsedTimer m_clock;
+    Counters m_counters[StageCount];
+    QVector<Event> m_events;
+    QHash<Qt::HANDLE, qint64> m_threadIds;
+    mutable QMutex m_mutex;
+    bool m_traceEnabled = false;
+    bool m_statisticsEnabled = false;
+
+    friend class ProfileScope;
+};
+
+/**
+ * The ProfileScope class measures the time spent in the enclosing scope and attributes
+ * it to the given stage of the import pipeline.
+ */
+class Q_DECL_EXPORT ProfileScope
+{
+public:
+    explicit ProfileScope(Profiler::Stage stage, int index = -1);
+    ~ProfileScope();
+
+    void addBytesRead(qint64 bytes);
+    void addBytesWritten(qint64 bytes);
+    void addFrames(int count);
+
+private:
+    qint64 m_start = 0;
+    qint64 m_cpuStart = 0;
+    qint64 m_residentMemoryStart = 0;
+    int m_index;
+    Profiler::Stage m_stage;
+    bool m_active;
+
+    Q_DISABLE_COPY(ProfileScope)
+};
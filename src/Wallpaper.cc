@@ -17,15 +17,29 @@
  */
 
 #include "Wallpaper.h"
+#include "BandReader.h"
+#include "FrameStore.h"
 
 Wallpaper::Wallpaper()
 {
 }
 
-Wallpaper::Wallpaper(Type type, const QVector<Image> &images)
-    : m_images(images)
+Wallpaper::Wallpaper(Type type, std::vector<Image> &&images)
+    : m_images(std::move(images))
+    , m_frames(std::make_shared<FrameStore>(int(m_images.size())))
     , m_type(type)
 {
+    for (int i = 0; i < int(m_images.size()); ++i)
+        m_frames->adopt(i, std::move(m_images[i].data));
+}
+
+Wallpaper::Wallpaper(Type type, std::vector<Image> &&images, std::shared_ptr<FrameStore> frames)
+    : m_images(std::move(images))
+    , m_frames(std::move(frames))
+    , m_type(type)
+{
+    for (Image &image : m_images)
+        image.data = QImage();
 }
 
 Wallpaper::Type Wallpaper::type() const
@@ -33,7 +47,82 @@ Wallpaper::Type Wallpaper::type() const
     return m_type;
 }
 
-QVector<Wallpaper::Image> Wallpaper::images() const
+int Wallpaper::imageCount() const
+{
+    return int(m_images.size());
+}
+
+Wallpaper::ImageRange Wallpaper::images() const
+{
+    return ImageRange(m_images.data(), m_images.data() + m_images.size());
+}
+
+const QImage &Wallpaper::pinImage(int index) const
+{
+    return m_frames->pin(index);
+}
+
+void Wallpaper::unpinImage(int index) const
+{
+    m_frames->unpin(index);
+}
+
+std::unique_ptr<BandReader> Wallpaper::openImage(int index) const
+{
+    return m_frames->openBands(index);
+}
+
+void Wallpaper::releaseImage(int index) const
+{
+    m_frames->release(index);
+}
+
+QImage Wallpaper::thumbnail(int index) const
+{
+    const QImage &thumbnail = m_images[index].thumbnail;
+    if (!thumbnail.isNull() || !m_thumbnailLoader)
+        return thumbnail;
+    return m_thumbnailLoader(index);
+}
+
+void Wallpaper::setThumbnailLoader(std::function<QImage(int)> loader)
+{
+    m_thumbnailLoader = loader;
+}
+
+QByteArray Wallpaper::encodedData(int index) const
+{
+    const QByteArray &encodedData = m_images[index].encodedData;
+    if (!encodedData.isNull() || m_images[index].encodedFormat.isEmpty() || !m_encodedDataLoader)
+        return encodedData;
+    return m_encodedDataLoader(index);
+}
+
+void Wallpaper::setEncodedDataLoader(std::function<QByteArray(int)> loader)
+{
+    m_encodedDataLoader = loader;
+}
+
+void Wallpaper::setEncodedPreview(const QSize &size, const QString &format, std::function<QByteArray()> loader)
+{
+    m_encodedPreviewSize = size;
+    m_encodedPreviewFormat = format;
+    m_encodedPreviewLoader = loader;
+}
+
+QSize Wallpaper::encodedPreviewSize() const
+{
+    return m_encodedPreviewSize;
+}
+
+QString Wallpaper::encodedPreviewFormat() const
+{
+    return m_encodedPreviewFormat;
+}
+
+QByteArray Wallpaper::encodedPreview() const
 {
-    return m_images;
+    if (!m_encodedPreviewLoader)
+        return QByteArray();
+    return m_encodedPreviewLoader();
 }
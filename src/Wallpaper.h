@@ -18,10 +18,16 @@
 
 #pragma once
 
+#include <QByteArray>
 #include <QImage>
 #include <QString>
 
+#include <functional>
 #include <memory>
+#include <vector>
+
+class BandReader;
+class FrameStore;
 
 /**
  * The Wallpaper class represents a dynamic wallpaper.
@@ -66,23 +72,103 @@ public:
         Timed,
     };
 
+    /**
+     * An image of the dynamic wallpaper along with its metadata.
+     *
+     * Images are move-only, so pixel data is never shared or copied by accident.
+     */
     struct Image
     {
-        // The filename of the image.
+        Image() = default;
+        Image(Image &&other) = default;
+        Image &operator=(Image &&other) = default;
+
+        // The pixel data of the image. It is moved into the wallpaper on construction,
+        // so it's null for images owned by a wallpaper; use Wallpaper::pinImage().
         QImage data;
 
+        // The thumbnail embedded in the source file, if the importer has loaded it along
+        // with the image. Otherwise it may be loaded on demand, see Wallpaper::thumbnail().
+        QImage thumbnail;
+
+        // The encoded image as found in the source, if the importer has loaded it along
+        // with the image. Otherwise it may be read on demand, see Wallpaper::encodedData().
+        // It may refer to a file that the wallpaper keeps mapped, so it must not outlive
+        // the wallpaper.
+        QByteArray encodedData;
+
+        // The file format of the encoded image in the source, e.g. "png", if it can be
+        // written out as is. It's empty if there is no encoded image.
+        QString encodedFormat;
+
         // The azimuth angle of the Sun, in degrees.
-        qreal azimuth;
+        qreal azimuth = 0;
 
         // The elevation angle of the Sun, in degrees.
-        qreal elevation;
+        qreal elevation = 0;
 
         // The time value, between 0 and 1.
-        qreal time;
+        qreal time = 0;
+
+    private:
+        Q_DISABLE_COPY(Image)
+    };
+
+    /**
+     * A non-owning view of the images stored in the wallpaper.
+     */
+    class ImageRange
+    {
+    public:
+        ImageRange(const Image *begin, const Image *end)
+            : m_begin(begin)
+            , m_end(end)
+        {
+        }
+
+        const Image *begin() const
+        {
+            return m_begin;
+        }
+
+        const Image *end() const
+        {
+            return m_end;
+        }
+
+        int count() const
+        {
+            return int(m_end - m_begin);
+        }
+
+        bool isEmpty() const
+        {
+            return m_begin == m_end;
+        }
+
+        const Image &operator[](int index) const
+        {
+            return m_begin[index];
+        }
+
+    private:
+        const Image *m_begin;
+        const Image *m_end;
     };
 
     Wallpaper();
-    Wallpaper(Type type, const QVector<Image> &images);
+
+    /**
+     * Constructs a dynamic wallpaper that takes over the given @p images, including
+     * their pixel data.
+     */
+    Wallpaper(Type type, std::vector<Image> &&images);
+
+    /**
+     * Constructs a dynamic wallpaper whose pixel data is owned by the given frame store.
+     * The data field of the given images is ignored.
+     */
+    Wallpaper(Type type, std::vector<Image> &&images, std::shared_ptr<FrameStore> frames);
 
     /**
      * Returns the type of the dynamic wallpaper.
@@ -90,11 +176,101 @@ public:
     Type type() const;
 
     /**
-     * Returns a list of all images stored in the wallpaper.
+     * Returns the number of images stored in the wallpaper.
+     */
+    int imageCount() const;
+
+    /**
+     * Returns all images stored in the wallpaper. The view is valid as long as the
+     * wallpaper is alive. Pixel data is accessed with pinImage().
+     */
+    ImageRange images() const;
+
+    /**
+     * Returns the pixel data of the image with the given @p index, loading it back
+     * from the disk if needed. Every successful call must be matched by unpinImage().
+     * The returned reference stays valid until then.
+     *
+     * This method will return a null image if the image doesn't fit in the memory budget
+     * or it has been released.
+     */
+    const QImage &pinImage(int index) const;
+
+    /**
+     * Allows the pixel data of the image with the given @p index to be spilled again.
+     */
+    void unpinImage(int index) const;
+
+    /**
+     * Opens the image with the given @p index for reading in horizontal bands, so large
+     * images can be processed without holding all of their pixel data in memory. The
+     * reader must not outlive the wallpaper.
+     *
+     * This method will return @c null if the image cannot be read or it has been released.
+     */
+    std::unique_ptr<BandReader> openImage(int index) const;
+
+    /**
+     * Frees the pixel data of the image with the given @p index for good, e.g. once it
+     * has been written. The metadata of the image stays available.
+     */
+    void releaseImage(int index) const;
+
+    /**
+     * Returns the thumbnail embedded in the source file for the image with the given
+     * @p index, or a null image if there is none. Thumbnails that haven't been loaded
+     * along with the image are decoded on every call, so callers should ask only for
+     * the thumbnails they need.
+     */
+    QImage thumbnail(int index) const;
+
+    /**
+     * Sets the function that decodes the embedded thumbnail of an image on demand.
+     */
+    void setThumbnailLoader(std::function<QImage(int)> loader);
+
+    /**
+     * Returns the encoded image with the given @p index as found in the source, or a null
+     * byte array if there is none. Encoded images that haven't been loaded along with the
+     * image are read on every call, so callers should only ask for the ones they write.
+     */
+    QByteArray encodedData(int index) const;
+
+    /**
+     * Sets the function that reads the encoded image with the given index on demand.
+     */
+    void setEncodedDataLoader(std::function<QByteArray(int)> loader);
+
+    /**
+     * Sets the preview found in the source, which has the given @p size and is encoded
+     * in the given @p format. Its encoded data is read on demand by @p loader.
+     */
+    void setEncodedPreview(const QSize &size, const QString &format, std::function<QByteArray()> loader);
+
+    /**
+     * Returns the size of the preview found in the source, or an invalid size if there
+     * is none.
+     */
+    QSize encodedPreviewSize() const;
+
+    /**
+     * Returns the file format of the preview found in the source, e.g. "png".
+     */
+    QString encodedPreviewFormat() const;
+
+    /**
+     * Reads the encoded data of the preview found in the source. This method will return
+     * a null byte array if there is no such preview or it can't be read.
      */
-    QVector<Image> images() const;
+    QByteArray encodedPreview() const;
 
 private:
-    QVector<Image> m_images;
+    std::vector<Image> m_images;
+    std::shared_ptr<FrameStore> m_frames;
+    std::function<QImage(int)> m_thumbnailLoader;
+    std::function<QByteArray(int)> m_encodedDataLoader;
+    std::function<QByteArray()> m_encodedPreviewLoader;
+    QSize m_encodedPreviewSize;
+    QString m_encodedPreviewFormat;
     Type m_type = Unknown;
 };
@@ -17,18 +17,52 @@
  */
 
 #include "Writer.h"
+#include "BandEncoder.h"
+#include "BandReader.h"
+#include "BufferPool.h"
+#include "ConcurrencyGovernor.h"
+#include "ContentStore.h"
+#include "ImageAnalysis.h"
+#include "ImportContext.h"
+#include "MemoryBudget.h"
+#include "PackageArchive.h"
+#include "Profiler.h"
 #include "Wallpaper.h"
 
+#include <QDebug>
+#include <QFile>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QPainter>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+Writer::Writer()
+{
+}
+
+Writer::~Writer()
+{
+}
+
 void Writer::setFormat(const QString &format)
 {
     m_format = format;
 }
 
+void Writer::setOutputs(const QVector<Output> &outputs)
+{
+    m_outputs = outputs;
+}
+
+int Writer::outputCount() const
+{
+    return std::max(m_outputs.count(), 1);
+}
+
 void Writer::setId(const QString &id)
 {
     m_id = id;
@@ -41,61 +75,579 @@ void Writer::setName(const QString &name)
 
 void Writer::setWallpaper(std::shared_ptr<Wallpaper> wallpaper)
 {
-    m_wallpaper = wallpaper;
+    m_wallpaper = std::move(wallpaper);
 }
 
-void Writer::write(const QString &targetPath)
+void Writer::setParts(Parts parts)
 {
-    if (!m_wallpaper)
-        return;
+    m_parts = parts;
+}
+
+void Writer::setPreviewSize(const QSize &size)
+{
+    m_previewSize = size;
+}
+
+void Writer::setContentStore(std::shared_ptr<ContentStore> store)
+{
+    m_contentStore = std::move(store);
+}
+
+void Writer::setPacked(bool packed)
+{
+    m_packed = packed;
+}
 
+bool Writer::isPacked() const
+{
+    return m_packed;
+}
+
+void Writer::setBandStreaming(bool enabled)
+{
+    m_bandStreaming = enabled;
+}
+
+void Writer::setReleaseImages(bool release)
+{
+    m_releaseImages = release;
+}
+
+void Writer::setContext(ImportContext *context)
+{
+    m_context = context;
+}
+
+bool Writer::isCanceled() const
+{
+    return m_context && m_context->isCanceled();
+}
+
+bool Writer::openTarget(Target *target, const QString &targetPath) const
+{
     QDir targetDirectory;
     if (targetPath.isEmpty())
         targetDirectory.setPath(QDir::currentPath());
     else
         targetDirectory.setPath(targetPath);
 
-    m_packageRoot.setPath(targetDirectory.filePath(m_id));
-    if (!m_packageRoot.exists())
-        m_packageRoot.mkpath(QStringLiteral("."));
+    if (m_packed) {
+        target->archive = std::make_unique<PackageArchiveWriter>(targetDirectory.filePath(m_id + QLatin1String(".dwpack")));
+        if (!target->archive->open()) {
+            qWarning() << "Could not create" << target->archive->fileName();
+            return false;
+        }
+    } else {
+        target->packageRoot.setPath(targetDirectory.filePath(m_id));
+        target->packageRoot.mkpath(QStringLiteral("contents/images"));
+    }
+
+    return true;
+}
+
+bool Writer::write(const QString &targetPath)
+{
+    if (!m_wallpaper)
+        return false;
+
+    QVector<Output> outputs = m_outputs;
+    if (outputs.isEmpty())
+        outputs.append(Output { m_format, targetPath });
+
+    for (const Output &output : qAsConst(outputs)) {
+        Target target;
+        target.format = output.format;
+        target.quality = output.quality;
+        target.imageFormats.resize(m_wallpaper->imageCount());
+        if (!openTarget(&target, output.targetPath)) {
+            m_targets.clear();
+            return false;
+        }
+        m_targets.push_back(std::move(target));
+    }
+
+    m_previewIndices = previewImageIndices();
+
+    bool written = true;
+    if (m_parts & Images)
+        written = writeImages();
+    if ((m_parts & Preview) && written && !isCanceled())
+        written = writePreview();
+    if (m_releaseImages) {
+        for (int index : qAsConst(m_previewIndices))
+            m_wallpaper->releaseImage(index);
+    }
+    if ((m_parts & MetaData) && written && !isCanceled()) {
+        const QJsonObject metaData = createMetaData();
+        for (const Target &target : m_targets) {
+            if (!writeMetaData(target, metaData)) {
+                qWarning() << "Could not write the metadata to" << filePath(target, QStringLiteral("metadata.json"));
+                written = false;
+                break;
+            }
+        }
+    }
+    written = written && !isCanceled();
+
+    // A canceled or failed packed file is discarded without touching the final path.
+    for (const Target &target : m_targets) {
+        if (!target.archive || !written)
+            continue;
+        if (!target.archive->commit()) {
+            qWarning() << "Could not write" << target.archive->fileName();
+            written = false;
+        } else if (m_context) {
+            m_context->fileWritten(target.archive->fileName());
+        }
+    }
+
+    m_targets.clear();
+
+    return written;
+}
+
+QString Writer::filePath(const Target &target, const QString &name) const
+{
+    if (target.archive)
+        return target.archive->fileName() + QLatin1Char('/') + name;
+    return target.packageRoot.filePath(name);
+}
+
+QString Writer::fileName(const QString &baseName, const QString &format) const
+{
+    return baseName + QLatin1Char('.') + format;
+}
+
+QString Writer::imageFormat(const Target &target, int index) const
+{
+    if (!target.imageFormats[index].isEmpty())
+        return target.imageFormats[index];
+    // Images that have not been written by this writer are assumed to be lossless.
+    return isAutomatic(target) ? QStringLiteral("png") : target.format;
+}
+
+QString Writer::previewFormat(const Target &target) const
+{
+    if (!target.previewFormat.isEmpty())
+        return target.previewFormat;
+    return isAutomatic(target) ? QStringLiteral("png") : target.format;
+}
+
+void Writer::forEachImage(const std::function<void(const Wallpaper::Image &, int)> &callback) const
+{
+    const Wallpaper::ImageRange images = m_wallpaper->images();
+    for (int i = 0; i < images.count(); ++i)
+        callback(images[i], i);
+}
+
+QVector<int> Writer::previewImageIndices() const
+{
+    const int midnightIndex = m_wallpaper->type() == Wallpaper::Solar ? solarMidnightImageIndex() : timedMidnightImageIndex();
+    const int noonIndex = m_wallpaper->type() == Wallpaper::Solar ? solarNoonImageIndex() : timedNoonImageIndex();
+    if (midnightIndex == -1 || noonIndex == -1)
+        return {};
+    if (midnightIndex == noonIndex)
+        return { midnightIndex };
+    return { midnightIndex, noonIndex };
+}
+
+static QString canonicalFormat(const QString &format)
+{
+    const QString lowerCaseFormat = format.toLower();
+    if (lowerCaseFormat == QLatin1String("jpeg"))
+        return QStringLiteral("jpg");
+    return lowerCaseFormat;
+}
+
+bool Writer::isAutomatic(const Target &target) const
+{
+    return target.format == QLatin1String("auto");
+}
+
+Writer::Codec Writer::selectCodec(const Target &target, const QImage &sample) const
+{
+    if (!isAutomatic(target))
+        return Codec { target.format, target.quality };
+
+    const ImageAnalysis analysis(sample);
+    if (analysis.prefersLossless())
+        return Codec { QStringLiteral("png") };
+    return Codec { QStringLiteral("jpg"), target.quality != -1 ? target.quality : analysis.suggestedQuality() };
+}
+
+QImage Writer::codecSample(int index, const QImage &firstBand) const
+{
+    // A band is usually a strip of sky, so the embedded thumbnail, which shows the whole
+    // image, is a much better sample. It's decoded on demand, so only when it's needed.
+    const bool automatic = std::any_of(m_targets.begin(), m_targets.end(), [this](const Target &target) {
+        return isAutomatic(target);
+    });
+    if (!automatic)
+        return firstBand;
+
+    const QImage thumbnail = m_wallpaper->thumbnail(index);
+    return thumbnail.isNull() ? firstBand : thumbnail;
+}
+
+bool Writer::isReusable(const QString &encodedFormat, const Target &target) const
+{
+    // The quality of the imported data is unknown.
+    if (encodedFormat.isEmpty() || target.quality != -1)
+        return false;
+
+    // Automatic targets keep images that are in either of the formats they choose from.
+    const QString format = canonicalFormat(encodedFormat);
+    if (isAutomatic(target))
+        return format == QLatin1String("png") || format == QLatin1String("jpg");
+    return format == canonicalFormat(target.format);
+}
+
+bool Writer::isReusable(const Wallpaper::Image &image, const Target &target) const
+{
+    return isReusable(image.encodedFormat, target);
+}
+
+bool Writer::isBandTarget(const Target &target) const
+{
+    return m_bandStreaming && (isAutomatic(target) || BandEncoder::supportsFormat(target.format));
+}
+
+QVector<int> Writer::bandTargetIndices(const Wallpaper::Image &image) const
+{
+    QVector<int> indices;
+    for (int i = 0; i < int(m_targets.size()); ++i) {
+        if (isBandTarget(m_targets[i]) && !isReusable(image, m_targets[i]))
+            indices.append(i);
+    }
+    return indices;
+}
+
+bool Writer::isEncodedToFile(const Target &target) const
+{
+    // Unless encoding and writing are timed separately, images are encoded straight to
+    // their files, without a copy of the encoded data in memory. Entries of a packed
+    // file are buffered, so that targets don't wait for each other to finish an entry,
+    // and so are images that have to be hashed before they're added to the store.
+    return !m_contentStore && !target.archive && !Profiler::isEnabled();
+}
+
+bool Writer::encodeImage(const Codec &codec, const QImage &image, ScratchBuffer *buffer) const
+{
+    ProfileScope scope(Profiler::Encode);
+
+    buffer->open(QIODevice::WriteOnly);
+    if (!image.save(buffer, codec.format.toLatin1(), codec.quality))
+        return false;
+
+    scope.addFrames(1);
+
+    return true;
+}
+
+bool Writer::encodeImageFile(const Target &target, const Codec &codec, const QImage &image, const QString &name) const
+{
+    const QString path = filePath(target, name);
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    if (!image.save(&file, codec.format.toLatin1(), codec.quality) || !file.flush())
+        return false;
+
+    if (m_context)
+        m_context->fileWritten(path);
+
+    return true;
+}
+
+bool Writer::writeImage(const Target &target, const Codec &codec, const QImage &image, const QString &name) const
+{
+    if (!m_contentStore) {
+        if (isEncodedToFile(target))
+            return encodeImageFile(target, codec, image, name);
+
+        ScratchBuffer buffer;
+        return encodeImage(codec, image, &buffer) && writeFile(target, buffer.data(), name);
+    }
+
+    const QByteArray key = ContentStore::key(image, codec.format, codec.quality);
+    ContentStore::Lock lock(m_contentStore.get());
+    if (m_contentStore->contains(key))
+        return writeStoredImage(target, key, QByteArray(), name);
+
+    ScratchBuffer buffer;
+    if (!encodeImage(codec, image, &buffer))
+        return false;
 
-    writeImages();
-    writePreview();
-    writeMetaData();
+    return writeStoredImage(target, key, buffer.data(), name);
 }
 
-QString Writer::fileName(const QString &baseName) const
+namespace {
+
+// Encodes an image that is fed in bands for one target and computes its key on the way.
+// The image is encoded straight to the file with the given path or, if there is none,
+// into memory.
+class BandStream
+{
+public:
+    BandStream(const QString &format, int quality, const QSize &size, QImage::Format pixelFormat, bool hashed,
+               const QString &filePath = QString())
+        : m_keyBuilder(size, pixelFormat, format, quality)
+        , m_hashed(hashed)
+    {
+        if (filePath.isEmpty()) {
+            m_buffer.open(QIODevice::WriteOnly);
+            m_encoder = BandEncoder::create(format, &m_buffer, quality);
+        } else {
+            m_file.setFileName(filePath);
+            if (m_file.open(QIODevice::WriteOnly))
+                m_encoder = BandEncoder::create(format, &m_file, quality);
+        }
+    }
+
+    bool begin(const QSize &size, bool hasAlphaChannel)
+    {
+        return m_encoder && m_encoder->begin(size, hasAlphaChannel);
+    }
+
+    bool writeBand(const QImage &band)
+    {
+        if (m_hashed)
+            m_keyBuilder.addBand(band);
+        return m_encoder->writeBand(band);
+    }
+
+    bool finish()
+    {
+        return m_encoder->finish() && (!m_file.isOpen() || m_file.flush());
+    }
+
+    bool isWrittenToFile() const
+    {
+        return m_file.isOpen();
+    }
+
+    QByteArray data() const
+    {
+        return m_buffer.data();
+    }
+
+    QByteArray key() const
+    {
+        return m_keyBuilder.result();
+    }
+
+private:
+    ScratchBuffer m_buffer;
+    QFile m_file;
+    std::unique_ptr<BandEncoder> m_encoder;
+    ContentKeyBuilder m_keyBuilder;
+    bool m_hashed;
+};
+
+} // namespace
+
+bool Writer::writeImageBands(int index, const QVector<int> &targetIndices) const
 {
-    return baseName + QLatin1Char('.') + m_format;
+    std::unique_ptr<BandReader> reader = m_wallpaper->openImage(index);
+    if (!reader)
+        return false;
+
+    const QSize size = reader->size();
+    const bool hasAlphaChannel = QImage::toPixelFormat(reader->format()).alphaUsage() == QPixelFormat::UsesAlpha;
+
+    // The encoders are set up before the image is read, so automatic targets choose the
+    // codec from the embedded thumbnail or, if there is none, from the first band.
+    QImage band = reader->readBand();
+    const QImage sample = codecSample(index, band);
+
+    std::vector<std::unique_ptr<BandStream>> streams;
+    std::vector<Codec> codecs;
+    {
+        ProfileScope scope(Profiler::Encode, index);
+
+        for (int targetIndex : targetIndices) {
+            const Target &target = m_targets[targetIndex];
+            const Codec codec = selectCodec(target, sample);
+            const QString name = QLatin1String("contents/images/") + fileName(QString::number(index), codec.format);
+            const QString path = isEncodedToFile(target) ? filePath(target, name) : QString();
+            streams.push_back(std::make_unique<BandStream>(codec.format, codec.quality, size, reader->format(), bool(m_contentStore), path));
+            codecs.push_back(codec);
+            if (!streams.back()->begin(size, hasAlphaChannel))
+                return false;
+        }
+    }
+
+    // Every band is read once and fed to the encoders of all targets. Reading a band
+    // may decode it, which is attributed to the decode stage by the reader, so only the
+    // encoding of every band is timed here.
+    for (; !band.isNull(); band = reader->readBand()) {
+        ProfileScope scope(Profiler::Encode, index);
+        for (const std::unique_ptr<BandStream> &stream : streams) {
+            if (!stream->writeBand(band))
+                return false;
+        }
+    }
+
+    {
+        ProfileScope scope(Profiler::Encode, index);
+
+        for (const std::unique_ptr<BandStream> &stream : streams) {
+            if (!stream->finish())
+                return false;
+        }
+
+        scope.addFrames(targetIndices.count());
+    }
+
+    bool written = true;
+    for (int i = 0; i < targetIndices.count(); ++i) {
+        const Target &target = m_targets[targetIndices[i]];
+        target.imageFormats[index] = codecs[i].format;
+        const QString name = QLatin1String("contents/images/") + fileName(QString::number(index), codecs[i].format);
+        if (streams[i]->isWrittenToFile()) {
+            if (m_context)
+                m_context->fileWritten(filePath(target, name));
+        } else if (!writeEncodedImage(target, streams[i]->key(), streams[i]->data(), name)) {
+            written = false;
+        }
+    }
+
+    return written;
+}
+
+bool Writer::writeEncodedImage(const Target &target, const QByteArray &key, const QByteArray &data, const QString &name) const
+{
+    if (!m_contentStore)
+        return writeFile(target, data, name);
+
+    // The key is only known once the whole image has been read, so the image is
+    // encoded even if it's already in the store.
+    ContentStore::Lock lock(m_contentStore.get());
+    return writeStoredImage(target, key, m_contentStore->contains(key) ? QByteArray() : data, name);
 }
 
-void Writer::forEachImage(std::function<void(const Wallpaper::Image &, int)> callback) const
+bool Writer::writeStoredImage(const Target &target, const QByteArray &key, const QByteArray &data, const QString &name) const
 {
-    const int imageCount = m_wallpaper->images().count();
-    for (int i = 0; i < imageCount; ++i) {
-        const Wallpaper::Image &image = m_wallpaper->images().at(i);
-        callback(image, i);
+    // Packed files can't link to the store, so nothing would keep the objects they add
+    // from being collected. They reuse objects that are there already but add none.
+    if (target.archive) {
+        if (!data.isNull())
+            return writeFile(target, data, name);
+        const QByteArray storedData = m_contentStore->read(key);
+        return !storedData.isNull() && writeFile(target, storedData, name);
+    }
+
+    if (!data.isNull()) {
+        ProfileScope scope(Profiler::Write);
+        if (!m_contentStore->insert(key, data))
+            return false;
+        scope.addBytesWritten(data.size());
+    }
+
+    const QString path = filePath(target, name);
+    {
+        ProfileScope scope(Profiler::Write);
+        if (!m_contentStore->link(key, path))
+            return false;
     }
+
+    if (m_context)
+        m_context->fileWritten(path);
+
+    return true;
 }
 
-void Writer::writeImages() const
+bool Writer::writeFile(const Target &target, const QByteArray &data, const QString &name) const
 {
-    const QDir imagesRoot = m_packageRoot.path() + QStringLiteral("/contents/images/");
-    if (!imagesRoot.exists())
-        imagesRoot.mkpath(QStringLiteral("."));
+    if (target.archive) {
+        if (!target.archive->add(name, data))
+            return false;
+    } else {
+        ProfileScope scope(Profiler::Write);
+
+        QFile file(filePath(target, name));
+        if (!file.open(QIODevice::WriteOnly))
+            return false;
+
+        const qint64 bytesWritten = file.write(data);
+        scope.addBytesWritten(bytesWritten);
+        if (bytesWritten != data.size())
+            return false;
+    }
+
+    if (m_context) {
+        if (target.archive)
+            m_context->entryWritten(target.archive->fileName(), name);
+        else
+            m_context->fileWritten(filePath(target, name));
+    }
 
-    forEachImage([=](const Wallpaper::Image &image, int index) {
-        const QString baseName = QString::number(index);
-        image.data.save(imagesRoot.filePath(fileName(baseName)));
+    return true;
+}
+
+bool Writer::writeImages() const
+{
+    // Frames needed by the preview are released once the preview has been written.
+    QVector<int> retainedIndices;
+    if (m_parts & Preview)
+        retainedIndices = m_previewIndices;
+
+    const Wallpaper::ImageRange images = m_wallpaper->images();
+    const int targetCount = int(m_targets.size());
+
+    // A frame is released once it has been written to all targets.
+    std::vector<std::atomic<int>> pendingTargetCounts(images.count());
+    for (std::atomic<int> &pendingTargetCount : pendingTargetCounts)
+        pendingTargetCount = targetCount;
+
+    // Images are encoded for all targets concurrently, each on the NUMA node that has
+    // decoded it. Once an image fails, the images that haven't started yet are skipped.
+    std::atomic<bool> failed { false };
+    ConcurrencyGovernor::self()->map(images.count(), targetCount, [&](int index, int targetIndex) {
+        if (isCanceled() || failed)
+            return;
+        const Target &target = m_targets[targetIndex];
+        bool written = true;
+        if (isReusable(images[index], target)) {
+            const QString format = isAutomatic(target) ? canonicalFormat(images[index].encodedFormat) : target.format;
+            target.imageFormats[index] = format;
+            const QByteArray encodedData = m_wallpaper->encodedData(index);
+            written = !encodedData.isEmpty()
+                && writeFile(target, encodedData, QLatin1String("contents/images/") + fileName(QString::number(index), format));
+        } else if (isBandTarget(target)) {
+            // All targets that are encoded in bands share one pass over the image.
+            const QVector<int> bandTargets = bandTargetIndices(images[index]);
+            if (bandTargets.first() == targetIndex)
+                written = writeImageBands(index, bandTargets);
+        } else {
+            const QImage &image = m_wallpaper->pinImage(index);
+            if (image.isNull()) {
+                qWarning() << "Image" << index << "does not fit in the memory budget";
+                failed = true;
+                return;
+            }
+            const Codec codec = selectCodec(target, image);
+            target.imageFormats[index] = codec.format;
+            written = writeImage(target, codec, image, QLatin1String("contents/images/") + fileName(QString::number(index), codec.format));
+            m_wallpaper->unpinImage(index);
+        }
+        if (!written && !isCanceled()) {
+            qWarning() << "Could not write image" << index;
+            failed = true;
+        }
+        if (--pendingTargetCounts[index] == 0 && m_releaseImages && !retainedIndices.contains(index))
+            m_wallpaper->releaseImage(index);
     });
+
+    return !failed;
 }
 
-void Writer::writeMetaData() const
+QJsonObject Writer::createMetaData() const
 {
-    QJsonDocument document;
     QJsonArray metaDataArray;
 
-    forEachImage([&](const Wallpaper::Image &image, int index) {
+    forEachImage([&](const Wallpaper::Image &image, int) {
         QJsonObject imageObject;
         switch (m_wallpaper->type()) {
         case Wallpaper::Solar:
@@ -109,7 +661,6 @@ void Writer::writeMetaData() const
             Q_UNREACHABLE();
             break;
         }
-        imageObject[QLatin1String("FileName")] = fileName(QString::number(index));
         metaDataArray.append(imageObject);
     });
 
@@ -118,7 +669,6 @@ void Writer::writeMetaData() const
         wallpaperObject[QLatin1String("Type")] = QLatin1String("solar");
     if (m_wallpaper->type() == Wallpaper::Timed)
         wallpaperObject[QLatin1String("Type")] = QLatin1String("timed");
-    wallpaperObject[QLatin1String("Preview")] = fileName(QStringLiteral("preview"));
     wallpaperObject[QLatin1String("MetaData")] = metaDataArray;
 
     QJsonObject pluginObject;
@@ -128,84 +678,181 @@ void Writer::writeMetaData() const
     QJsonObject root;
     root[QLatin1String("KPlugin")] = pluginObject;
     root[QLatin1String("Wallpaper")] = wallpaperObject;
-    document.setObject(root);
 
-    QFile file(m_packageRoot.path() + QLatin1String("/metadata.json"));
-    if (!file.open(QIODevice::WriteOnly))
-        return;
+    return root;
+}
+
+bool Writer::writeMetaData(const Target &target, QJsonObject metaData) const
+{
+    // Only file names differ between targets.
+    QJsonObject wallpaperObject = metaData.value(QLatin1String("Wallpaper")).toObject();
+    QJsonArray metaDataArray = wallpaperObject.value(QLatin1String("MetaData")).toArray();
+    for (int i = 0; i < metaDataArray.count(); ++i) {
+        QJsonObject imageObject = metaDataArray.at(i).toObject();
+        imageObject[QLatin1String("FileName")] = fileName(QString::number(i), imageFormat(target, i));
+        metaDataArray.replace(i, imageObject);
+    }
+    wallpaperObject[QLatin1String("Preview")] = fileName(QStringLiteral("preview"), previewFormat(target));
+    wallpaperObject[QLatin1String("MetaData")] = metaDataArray;
+    metaData[QLatin1String("Wallpaper")] = wallpaperObject;
 
-    file.write(document.toJson(QJsonDocument::Indented));
+    const QJsonDocument document(metaData);
+    return writeFile(target, document.toJson(QJsonDocument::Indented), QStringLiteral("metadata.json"));
 }
 
-QImage Writer::solarNoonImage() const
+int Writer::solarNoonImageIndex() const
 {
-    QImage noonImage;
+    int noonIndex = -1;
 
     qreal highestElevation = -90;
-    forEachImage([&](const Wallpaper::Image &image, int) {
+    forEachImage([&](const Wallpaper::Image &image, int index) {
         if (image.elevation < highestElevation)
             return;
-        noonImage = image.data;
+        noonIndex = index;
         highestElevation = image.elevation;
     });
 
-    return noonImage;
+    return noonIndex;
 }
 
-QImage Writer::timedNoonImage() const
+int Writer::timedNoonImageIndex() const
 {
-    QImage noonImage;
+    int noonIndex = -1;
 
     qreal bestScore = 1;
-    forEachImage([&](const Wallpaper::Image &image, int) {
+    forEachImage([&](const Wallpaper::Image &image, int index) {
         const qreal score = std::abs(image.time - 0.5);
         if (bestScore < score)
             return;
-        noonImage = image.data;
+        noonIndex = index;
         bestScore = score;
     });
 
-    return noonImage;
+    return noonIndex;
 }
 
-QImage Writer::solarMidnightImage() const
+int Writer::solarMidnightImageIndex() const
 {
-    QImage midnightImage;
+    int midnightIndex = -1;
 
     qreal lowestElevation = 90;
-    forEachImage([&](const Wallpaper::Image &image, int) {
+    forEachImage([&](const Wallpaper::Image &image, int index) {
         if (lowestElevation < image.elevation)
             return;
-        midnightImage = image.data;
+        midnightIndex = index;
         lowestElevation = image.elevation;
     });
 
-    return midnightImage;
+    return midnightIndex;
 }
 
-QImage Writer::timedMidnightImage() const
+int Writer::timedMidnightImageIndex() const
 {
-    QImage midnightImage;
+    int midnightIndex = -1;
 
     qreal bestScore = 1;
-    forEachImage([&](const Wallpaper::Image &image, int) {
+    forEachImage([&](const Wallpaper::Image &image, int index) {
         const qreal score = std::min(image.time, 1 - image.time);
         if (bestScore < score)
             return;
-        midnightImage = image.data;
+        midnightIndex = index;
         bestScore = score;
     });
 
-    return midnightImage;
+    return midnightIndex;
 }
 
-void Writer::writePreview() const
+bool Writer::isSufficientThumbnail(const QImage &thumbnail) const
 {
-    const QImage midnightImage = m_wallpaper->type() == Wallpaper::Solar ? solarMidnightImage() : timedMidnightImage();
-    const QImage noonImage = m_wallpaper->type() == Wallpaper::Solar ? solarNoonImage() : timedNoonImage();
+    if (!m_previewSize.isValid() || thumbnail.isNull())
+        return false;
+    return thumbnail.width() >= m_previewSize.width() && thumbnail.height() >= m_previewSize.height();
+}
+
+bool Writer::writePreview() const
+{
+    if (m_previewIndices.isEmpty())
+        return true;
+
+    const int midnightIndex = m_previewIndices.first();
+    const int noonIndex = m_previewIndices.last();
+
+    // A preview of the requested size that comes with the source, e.g. a package that
+    // is converted to another format, is written as is.
+    if (m_previewSize.isValid() && m_wallpaper->encodedPreviewSize() == m_previewSize) {
+        const QString encodedFormat = m_wallpaper->encodedPreviewFormat();
+        const bool reusable = std::all_of(m_targets.begin(), m_targets.end(), [this, &encodedFormat](const Target &target) {
+            return isReusable(encodedFormat, target);
+        });
+        const QByteArray encodedData = reusable ? m_wallpaper->encodedPreview() : QByteArray();
+        if (!encodedData.isEmpty())
+            return writeEncodedPreview(encodedData);
+    }
 
-    const QSize previewSize = midnightImage.size().expandedTo(noonImage.size());
-    QImage previewImage(previewSize, QImage::Format_RGB888);
+    // Embedded thumbnails are much cheaper than full frames, which may even have not
+    // been decoded yet. They can only stand in for a preview of a given size, and
+    // they are decoded on demand, so they're not even asked for otherwise.
+    if (m_previewSize.isValid()) {
+        const QImage midnightThumbnail = m_wallpaper->thumbnail(midnightIndex);
+        if (isSufficientThumbnail(midnightThumbnail)) {
+            const QImage noonThumbnail = noonIndex == midnightIndex ? midnightThumbnail : m_wallpaper->thumbnail(noonIndex);
+            if (isSufficientThumbnail(noonThumbnail))
+                return composePreview(midnightThumbnail, noonThumbnail);
+        }
+    }
+
+    const bool bandTargets = std::all_of(m_targets.begin(), m_targets.end(), [this](const Target &target) {
+        return isBandTarget(target);
+    });
+    if (bandTargets && !m_previewSize.isValid()) {
+        if (composePreviewBands(midnightIndex, noonIndex))
+            return true;
+    }
+
+    const QImage &midnightImage = m_wallpaper->pinImage(midnightIndex);
+    const QImage &noonImage = m_wallpaper->pinImage(noonIndex);
+
+    bool written = false;
+    if (!midnightImage.isNull() && !noonImage.isNull())
+        written = composePreview(midnightImage, noonImage);
+    else
+        qWarning() << "The preview images do not fit in the memory budget";
+
+    if (!noonImage.isNull())
+        m_wallpaper->unpinImage(noonIndex);
+    if (!midnightImage.isNull())
+        m_wallpaper->unpinImage(midnightIndex);
+
+    return written;
+}
+
+bool Writer::writeEncodedPreview(const QByteArray &encodedData) const
+{
+    const QString encodedFormat = m_wallpaper->encodedPreviewFormat();
+    for (const Target &target : m_targets) {
+        const QString format = isAutomatic(target) ? canonicalFormat(encodedFormat) : target.format;
+        target.previewFormat = format;
+        if (!writeFile(target, encodedData, QLatin1String("contents/images/") + fileName(QStringLiteral("preview"), format))) {
+            qWarning() << "Could not write the preview";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Writer::composePreview(const QImage &midnightImage, const QImage &noonImage) const
+{
+    QSize previewSize = m_previewSize;
+    if (!previewSize.isValid())
+        previewSize = midnightImage.size().expandedTo(noonImage.size());
+
+    // The pool charges the preview to the memory budget until it's freed.
+    QImage previewImage = BufferPool::self()->createImage(previewSize, QImage::Format_RGB888);
+    if (previewImage.isNull()) {
+        qWarning() << "The preview does not fit in the memory budget";
+        return false;
+    }
 
     const QRect targetLeftHalfRect(0, 0, previewImage.width() / 2, previewImage.height());
     const QRect targetRightHalfRect(previewImage.width() / 2, 0, previewImage.width() / 2, previewImage.height());
@@ -213,9 +860,144 @@ void Writer::writePreview() const
     const QRect sourceRightHalfRect(noonImage.width() / 2, 0, noonImage.width() / 2, noonImage.height());
 
     QPainter painter(&previewImage);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform);
     painter.drawImage(targetLeftHalfRect, midnightImage, sourceLeftHalfRect);
     painter.drawImage(targetRightHalfRect, noonImage, sourceRightHalfRect);
     painter.end();
 
-    previewImage.save(m_packageRoot.path() + QLatin1String("/contents/images/") + fileName(QStringLiteral("preview")));
+    // The preview is composed once and encoded for all targets concurrently.
+    std::atomic<bool> failed { false };
+    ConcurrencyGovernor::self()->map(1, int(m_targets.size()), [&](int, int targetIndex) {
+        const Target &target = m_targets[targetIndex];
+        const Codec codec = selectCodec(target, previewImage);
+        target.previewFormat = codec.format;
+        if (!writeImage(target, codec, previewImage, QLatin1String("contents/images/") + fileName(QStringLiteral("preview"), codec.format)))
+            failed = true;
+    });
+
+    if (failed)
+        qWarning() << "Could not write the preview";
+
+    return !failed;
+}
+
+namespace {
+
+// Serves the rows of a band reader one at a time, converted to RGB888.
+class RowReader
+{
+public:
+    explicit RowReader(BandReader *reader)
+        : m_reader(reader)
+    {
+    }
+
+    const uchar *next()
+    {
+        if (m_row == m_band.height()) {
+            m_band = m_reader->readBand();
+            m_row = 0;
+            if (m_band.isNull())
+                return nullptr;
+            if (m_band.format() != QImage::Format_RGB888)
+                m_band = m_band.convertToFormat(QImage::Format_RGB888);
+        }
+        return m_band.constScanLine(m_row++);
+    }
+
+private:
+    BandReader *m_reader;
+    QImage m_band;
+    int m_row = 0;
+};
+
+} // namespace
+
+bool Writer::composePreviewBands(int midnightIndex, int noonIndex) const
+{
+    std::unique_ptr<BandReader> midnightReader = m_wallpaper->openImage(midnightIndex);
+    std::unique_ptr<BandReader> noonReader = midnightIndex == noonIndex ? nullptr : m_wallpaper->openImage(noonIndex);
+    BandReader *noonSource = noonReader ? noonReader.get() : midnightReader.get();
+    if (!midnightReader || !noonSource || midnightReader->size() != noonSource->size())
+        return false;
+
+    // The left half comes from the midnight image and the right half from the noon image,
+    // both at their native size, so the preview is put together one band at a time.
+    const QSize size = midnightReader->size();
+    const int leftHalfSize = size.width() / 2 * 3;
+    const int rightHalfSize = size.width() * 3 - leftHalfSize;
+    const int bandHeight = BandReader::bandHeight(size.width() * 3);
+
+    QImage band = BufferPool::self()->createImage(QSize(size.width(), bandHeight), QImage::Format_RGB888);
+    if (band.isNull())
+        return false;
+
+    RowReader midnightRows(midnightReader.get());
+    RowReader noonRows(noonSource);
+
+    std::vector<std::unique_ptr<BandStream>> streams;
+    std::vector<Codec> codecs;
+
+    // Rows are read, and possibly decoded, outside of the encode scopes, see
+    // writeImageBands().
+    for (int y = 0; y < size.height(); y += bandHeight) {
+        const int rows = std::min(bandHeight, size.height() - y);
+        for (int row = 0; row < rows; ++row) {
+            const uchar *midnightRow = midnightRows.next();
+            const uchar *noonRow = noonSource == midnightReader.get() ? midnightRow : noonRows.next();
+            if (!midnightRow || !noonRow)
+                return false;
+            std::memcpy(band.scanLine(row), midnightRow, leftHalfSize);
+            std::memcpy(band.scanLine(row) + leftHalfSize, noonRow + leftHalfSize, rightHalfSize);
+        }
+
+        const QImage rowsImage(band.constBits(), size.width(), rows, band.bytesPerLine(), QImage::Format_RGB888);
+
+        ProfileScope scope(Profiler::Encode);
+
+        // Automatic targets choose the codec like for images, see writeImageBands().
+        if (streams.empty()) {
+            const QImage sample = codecSample(midnightIndex, rowsImage);
+            for (const Target &target : m_targets) {
+                const Codec codec = selectCodec(target, sample);
+                const QString name = QLatin1String("contents/images/") + fileName(QStringLiteral("preview"), codec.format);
+                const QString path = isEncodedToFile(target) ? filePath(target, name) : QString();
+                streams.push_back(std::make_unique<BandStream>(codec.format, codec.quality, size, QImage::Format_RGB888, bool(m_contentStore), path));
+                codecs.push_back(codec);
+                if (!streams.back()->begin(size, false))
+                    return false;
+            }
+        }
+
+        for (const std::unique_ptr<BandStream> &stream : streams) {
+            if (!stream->writeBand(rowsImage))
+                return false;
+        }
+    }
+
+    {
+        ProfileScope scope(Profiler::Encode);
+
+        for (const std::unique_ptr<BandStream> &stream : streams) {
+            if (!stream->finish())
+                return false;
+        }
+
+        scope.addFrames(int(streams.size()));
+    }
+
+    bool written = true;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        const Target &target = m_targets[i];
+        target.previewFormat = codecs[i].format;
+        const QString name = QLatin1String("contents/images/") + fileName(QStringLiteral("preview"), codecs[i].format);
+        if (streams[i]->isWrittenToFile()) {
+            if (m_context)
+                m_context->fileWritten(filePath(target, name));
+        } else if (!writeEncodedImage(target, streams[i]->key(), streams[i]->data(), name)) {
+            written = false;
+        }
+    }
+
+    return written;
 }
@@ -22,18 +22,71 @@
 
 #include <QDir>
 #include <QString>
+#include <QVector>
 
 #include <functional>
 #include <memory>
+#include <vector>
+
+class ContentStore;
+class ImportContext;
+class PackageArchiveWriter;
+class QJsonObject;
+class ScratchBuffer;
 
 class Q_DECL_EXPORT Writer
 {
 public:
     /**
-     * Sets the preferred image file extension.
+     * This enum type is used to specify what parts of the wallpaper package are written.
+     */
+    enum Part {
+        Images = 0x1,
+        Preview = 0x2,
+        MetaData = 0x4,
+        All = Images | Preview | MetaData,
+    };
+    Q_DECLARE_FLAGS(Parts, Part)
+
+    /**
+     * This struct describes a package that is written from the decoded images.
+     */
+    struct Output
+    {
+        QString format;
+        QString targetPath;
+        int quality = -1;
+    };
+
+    Writer();
+    ~Writer();
+
+    /**
+     * Sets the preferred image file extension. Images that have been imported already
+     * encoded in this format, e.g. from a package, are written as is.
+     *
+     * With the @c auto format, every image is written as PNG or JPEG depending on its
+     * content, see ImageAnalysis. The quality of an output with this format is then the
+     * JPEG quality; if it's not set, it's chosen per image as well.
      */
     void setFormat(const QString &format);
 
+    /**
+     * Sets the packages that should be written, e.g. a PNG package for archival and a
+     * JPEG package for deployment. Every image is decoded once and encoded for all
+     * outputs concurrently, and the metadata is generated once. The outputs must have
+     * distinct target paths.
+     *
+     * If no outputs are set, a single package in the format passed to setFormat() is
+     * written to the target path passed to write().
+     */
+    void setOutputs(const QVector<Output> &outputs);
+
+    /**
+     * Returns the number of packages that write() produces.
+     */
+    int outputCount() const;
+
     /**
      * Sets the preferred id of the wallpaper.
      */
@@ -50,26 +103,135 @@ public:
     void setWallpaper(std::shared_ptr<Wallpaper> wallpaper);
 
     /**
-     * Writes the dynamic wallpaper to the disk.
+     * Sets what parts of the wallpaper package should be written. All parts are written
+     * by default.
+     */
+    void setParts(Parts parts);
+
+    /**
+     * Sets the size of the preview image. If the size is not valid, the preview is as
+     * large as the largest image. If embedded thumbnails are at least as large as the
+     * requested size, the preview is made from them rather than from the full images.
      */
-    void write(const QString &targetPath = QString());
+    void setPreviewSize(const QSize &size);
+
+    /**
+     * Sets the content-addressed store that encoded images are shared through. Images
+     * that are already in the store are not encoded again.
+     */
+    void setContentStore(std::shared_ptr<ContentStore> store);
+
+    /**
+     * Sets the context that is notified about written files. The writer stops early if
+     * the context gets canceled.
+     */
+    void setContext(ImportContext *context);
+
+    /**
+     * Sets whether the package should be written as a single packed file named after
+     * the id of the wallpaper rather than as a directory tree. See PackageArchive.
+     */
+    void setPacked(bool packed);
+    bool isPacked() const;
+
+    /**
+     * Sets whether images should be read, converted and encoded in horizontal bands
+     * rather than as a whole, which bounds the working memory per image regardless of
+     * its resolution. Only PNG and JPEG images can be encoded in bands. Disabled by
+     * default.
+     */
+    void setBandStreaming(bool enabled);
+
+    /**
+     * Sets whether the pixel data of images should be freed as soon as the writer is
+     * done with them. The wallpaper can't be written again afterwards. Images are kept
+     * by default.
+     */
+    void setReleaseImages(bool release);
+
+    /**
+     * Writes the dynamic wallpaper to the disk. The @p targetPath is used only if no
+     * outputs have been set.
+     *
+     * Writing stops at the first file that cannot be written. Returns @c false if the
+     * wallpaper has not been written completely, including if it has been canceled.
+     */
+    bool write(const QString &targetPath = QString());
 
 private:
-    void forEachImage(std::function<void(const Wallpaper::Image &, int)> callback) const;
+    struct Codec
+    {
+        QString format;
+        int quality = -1;
+    };
+
+    struct Target
+    {
+        QString format;
+        int quality = -1;
+        QDir packageRoot;
+        std::unique_ptr<PackageArchiveWriter> archive;
 
-    QString fileName(const QString &baseName) const;
-    QImage solarNoonImage() const;
-    QImage timedNoonImage() const;
-    QImage solarMidnightImage() const;
-    QImage timedMidnightImage() const;
+        // The formats that images have been written in, if they are chosen per image.
+        // Each slot is only touched by the task that writes the image.
+        mutable std::vector<QString> imageFormats;
+        mutable QString previewFormat;
+    };
 
-    void writeImages() const;
-    void writeMetaData() const;
-    void writePreview() const;
+    bool isCanceled() const;
+    bool openTarget(Target *target, const QString &targetPath) const;
 
-    QDir m_packageRoot;
+    void forEachImage(const std::function<void(const Wallpaper::Image &, int)> &callback) const;
+    QVector<int> previewImageIndices() const;
+
+    QString fileName(const QString &baseName, const QString &format) const;
+    QString imageFormat(const Target &target, int index) const;
+    QString previewFormat(const Target &target) const;
+    QString filePath(const Target &target, const QString &name) const;
+    int solarNoonImageIndex() const;
+    int timedNoonImageIndex() const;
+    int solarMidnightImageIndex() const;
+    int timedMidnightImageIndex() const;
+
+    bool isAutomatic(const Target &target) const;
+    Codec selectCodec(const Target &target, const QImage &sample) const;
+    QImage codecSample(int index, const QImage &firstBand) const;
+    bool isReusable(const QString &encodedFormat, const Target &target) const;
+    bool isReusable(const Wallpaper::Image &image, const Target &target) const;
+    bool isBandTarget(const Target &target) const;
+    QVector<int> bandTargetIndices(const Wallpaper::Image &image) const;
+    bool isEncodedToFile(const Target &target) const;
+    bool encodeImage(const Codec &codec, const QImage &image, ScratchBuffer *buffer) const;
+    bool encodeImageFile(const Target &target, const Codec &codec, const QImage &image, const QString &name) const;
+    bool writeImage(const Target &target, const Codec &codec, const QImage &image, const QString &name) const;
+    bool writeImageBands(int index, const QVector<int> &targetIndices) const;
+    bool writeEncodedImage(const Target &target, const QByteArray &key, const QByteArray &data, const QString &name) const;
+    bool writeStoredImage(const Target &target, const QByteArray &key, const QByteArray &data, const QString &name) const;
+    bool writeFile(const Target &target, const QByteArray &data, const QString &name) const;
+
+    bool writeImages() const;
+    QJsonObject createMetaData() const;
+    bool writeMetaData(const Target &target, QJsonObject metaData) const;
+    bool writePreview() const;
+    bool writeEncodedPreview(const QByteArray &encodedData) const;
+    bool composePreview(const QImage &midnightImage, const QImage &noonImage) const;
+    bool composePreviewBands(int midnightIndex, int noonIndex) const;
+    bool isSufficientThumbnail(const QImage &thumbnail) const;
+
+    QSize m_previewSize;
     QString m_format;
     QString m_id;
     QString m_name;
+    QVector<Output> m_outputs;
+    QVector<int> m_previewIndices;
+    std::vector<Target> m_targets;
     std::shared_ptr<Wallpaper> m_wallpaper;
+    std::shared_ptr<ContentStore> m_contentStore;
+    ImportContext *m_context = nullptr;
+    Parts m_parts = All;
+    bool m_bandStreaming = false;
+    bool m_packed = false;
+    bool m_releaseImages = false;
 };
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(Writer::Parts)
@@ -17,25 +17,219 @@
  */
 
 #include "HeicImporter.h"
+#include "BandReader.h"
+#include "BufferPool.h"
+#include "ConcurrencyGovernor.h"
+#include "FrameStore.h"
+#include "ImportContext.h"
+#include "MemoryBudget.h"
+#include "Profiler.h"
 #include "Wallpaper.h"
 
 #include <QDomDocument>
+#include <QFileInfo>
 #include <QLoggingCategory>
 #include <QMimeDatabase>
 
 #include <libheif/heif.h>
 #include <plist/plist.h>
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
 Q_LOGGING_CATEGORY(heic, "heic")
 
-struct HeifContextDeleter
+#if defined(LIBHEIF_HAVE_VERSION)
+#if LIBHEIF_HAVE_VERSION(1, 13, 0)
+#define HAVE_HEIF_MAX_DECODING_THREADS
+#endif
+#if LIBHEIF_HAVE_VERSION(1, 18, 0)
+#define HAVE_HEIF_CANCEL_DECODING
+#endif
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+#define HAVE_HEIF_IMAGE_TILING
+#endif
+#endif
+
+struct HeifImageHandleDeleter
+{
+    static void cleanup(heif_image_handle *handle)
+    {
+        heif_image_handle_release(handle);
+    }
+};
+
+struct HeifImageDeleter
+{
+    static void cleanup(heif_image *image)
+    {
+        heif_image_release(image);
+    }
+};
+
+struct HeifDecodingOptionsDeleter
 {
-    static void cleanup(heif_context *context)
+    static void cleanup(heif_decoding_options *options)
     {
-        heif_context_free(context);
+        heif_decoding_options_free(options);
     }
 };
 
+static void releaseHeifImage(void *image)
+{
+    heif_image_release(static_cast<heif_image *>(image));
+}
+
+#if defined(HAVE_HEIF_CANCEL_DECODING)
+static int cancelDecoding(void *userData)
+{
+    return static_cast<ImportContext *>(userData)->isCanceled();
+}
+#endif
+
+#if defined(HAVE_HEIF_IMAGE_TILING)
+/**
+ * Decodes a tiled image, e.g. the grid images of macOS wallpapers, one row of tiles at
+ * a time, so only a band of the frame is ever in memory.
+ */
+class HeifBandReader : public BandReader
+{
+public:
+    HeifBandReader(std::shared_ptr<heif_context> context, heif_image_handle *handle, const heif_image_tiling &tiling, int index, ImportContext *importContext);
+
+    bool isValid() const;
+
+    QSize size() const override;
+    QImage::Format format() const override;
+    QImage readBand() override;
+
+private:
+    static qint64 workingSize(const heif_image_tiling &tiling);
+    bool decodeTile(uint32_t column, int tileTop, int firstRow, int rowCount);
+
+    std::shared_ptr<heif_context> m_context;
+    QScopedPointer<heif_image_handle, HeifImageHandleDeleter> m_handle;
+    QScopedPointer<heif_decoding_options, HeifDecodingOptionsDeleter> m_options;
+    heif_image_tiling m_tiling;
+    MemoryReservation m_reservation;
+    QImage m_band;
+    ImportContext *m_importContext;
+    int m_index;
+    uint32_t m_tileRow = 0;
+};
+
+HeifBandReader::HeifBandReader(std::shared_ptr<heif_context> context, heif_image_handle *handle, const heif_image_tiling &tiling, int index, ImportContext *importContext)
+    : m_context(context)
+    , m_handle(handle)
+    , m_options(heif_decoding_options_alloc())
+    , m_tiling(tiling)
+    , m_reservation(workingSize(tiling))
+    , m_importContext(importContext)
+    , m_index(index)
+{
+#if defined(HAVE_HEIF_CANCEL_DECODING)
+    if (m_importContext) {
+        m_options->cancel_decoding = cancelDecoding;
+        m_options->progress_user_data = m_importContext;
+    }
+#endif
+
+    if (m_reservation.isValid())
+        m_band = BufferPool::self()->createImage(QSize(tiling.image_width, tiling.tile_height), QImage::Format_RGB888);
+}
+
+qint64 HeifBandReader::workingSize(const heif_image_tiling &tiling)
+{
+    // A decoded tile and its YCbCr 4:2:0 planes. The band of the output frame is
+    // charged by the buffer pool.
+    const qint64 tileBytes = qint64(tiling.tile_width) * tiling.tile_height * 3;
+    return tileBytes + tileBytes / 2;
+}
+
+bool HeifBandReader::isValid() const
+{
+    return !m_band.isNull();
+}
+
+QSize HeifBandReader::size() const
+{
+    return QSize(m_tiling.image_width, m_tiling.image_height);
+}
+
+QImage::Format HeifBandReader::format() const
+{
+    return QImage::Format_RGB888;
+}
+
+bool HeifBandReader::decodeTile(uint32_t column, int tileTop, int firstRow, int rowCount)
+{
+    const int tileLeft = int(column * m_tiling.tile_width) - int(m_tiling.left_offset);
+    const int firstColumn = std::max(0, tileLeft);
+    const int lastColumn = std::min(int(m_tiling.image_width), tileLeft + int(m_tiling.tile_width));
+    if (lastColumn <= firstColumn)
+        return true;
+
+    if (m_importContext && m_importContext->isCanceled())
+        return false;
+
+    heif_image *tile = nullptr;
+    const heif_error error = heif_image_handle_decode_image_tile(m_handle.data(), &tile, heif_colorspace_RGB,
+                                                                 heif_chroma_interleaved_24bit, m_options.data(), column, m_tileRow);
+    QScopedPointer<heif_image, HeifImageDeleter> tileGuard(tile);
+    if (m_importContext && m_importContext->isCanceled())
+        return false;
+    if (error.code != heif_error_Ok) {
+        qCWarning(heic, "Could not decode a tile of image %d: %s", m_index, error.message);
+        return false;
+    }
+
+    int stride = 0;
+    const uint8_t *data = heif_image_get_plane_readonly(tile, heif_channel_interleaved, &stride);
+    if (!data)
+        return false;
+
+    const int sourceX = firstColumn - tileLeft;
+    const int sourceY = firstRow - tileTop;
+    const int columns = std::min(lastColumn - firstColumn, heif_image_get_width(tile, heif_channel_interleaved) - sourceX);
+    const int rows = std::min(rowCount, heif_image_get_height(tile, heif_channel_interleaved) - sourceY);
+    for (int row = 0; row < rows; ++row)
+        std::memcpy(m_band.scanLine(row) + firstColumn * 3, data + qint64(sourceY + row) * stride + sourceX * 3, columns * 3);
+
+    return true;
+}
+
+QImage HeifBandReader::readBand()
+{
+    while (m_tileRow < m_tiling.num_rows) {
+        const int tileTop = int(m_tileRow * m_tiling.tile_height) - int(m_tiling.top_offset);
+        const int firstRow = std::max(0, tileTop);
+        const int lastRow = std::min(int(m_tiling.image_height), tileTop + int(m_tiling.tile_height));
+        if (lastRow <= firstRow) {
+            ++m_tileRow;
+            continue;
+        }
+
+        ProfileScope scope(Profiler::Decode, m_index);
+
+        const int rowCount = lastRow - firstRow;
+        for (uint32_t column = 0; column < m_tiling.num_columns; ++column) {
+            if (!decodeTile(column, tileTop, firstRow, rowCount))
+                return QImage();
+        }
+        ++m_tileRow;
+
+        if (m_tileRow == m_tiling.num_rows)
+            scope.addFrames(1);
+
+        return QImage(m_band.constBits(), m_band.width(), rowCount, m_band.bytesPerLine(), QImage::Format_RGB888);
+    }
+
+    return QImage();
+}
+#endif
+
 HeicImporter::HeicImporter(QObject *parent)
     : Importer(parent)
 {
@@ -45,39 +239,219 @@ HeicImporter::~HeicImporter()
 {
 }
 
-static QVector<Wallpaper::Image> discoverImages(heif_context *context)
+static bool decodeImage(heif_context *context, heif_item_id id, int index, FrameStore *frames, ImportContext *importContext)
+{
+    if (importContext && importContext->isCanceled())
+        return false;
+
+    ProfileScope scope(Profiler::Decode, index);
+
+    heif_image_handle *handle = nullptr;
+    heif_error error = heif_context_get_image_handle(context, id, &handle);
+    if (error.code != heif_error_Ok) {
+        qCWarning(heic, "Could not get handle of image %d: %s", index, error.message);
+        return false;
+    }
+    QScopedPointer<heif_image_handle, HeifImageHandleDeleter> handleGuard(handle);
+
+    const int width = heif_image_handle_get_width(handle);
+    const int height = heif_image_handle_get_height(handle);
+
+    // The interleaved output plane, whose rows libheif aligns to at most 64 bytes, plus
+    // the intermediate YCbCr 4:2:0 planes or, if the context provides the frame, the
+    // frame that the output plane is copied to.
+    const qint64 planeBytes = qint64((width * 3 + 63) & ~63) * height;
+    const qint64 intermediateBytes = qint64(width) * height * 3 / 2;
+    const qint64 allocatedBytes = qint64((width * 3 + 3) & ~3) * height;
+    const qint64 workingBytes = planeBytes + std::max(intermediateBytes, importContext ? allocatedBytes : 0);
+
+    MemoryReservation reservation(workingBytes);
+    if (!reservation.isValid()) {
+        qCWarning(heic, "Image %d does not fit in the memory budget", index);
+        return false;
+    }
+
+    QScopedPointer<heif_decoding_options, HeifDecodingOptionsDeleter> options(heif_decoding_options_alloc());
+#if defined(HAVE_HEIF_CANCEL_DECODING)
+    if (importContext) {
+        options->cancel_decoding = cancelDecoding;
+        options->progress_user_data = importContext;
+    }
+#endif
+
+    heif_image *image = nullptr;
+    error = heif_decode_image(handle, &image, heif_colorspace_RGB, heif_chroma_interleaved_24bit, options.data());
+    QScopedPointer<heif_image, HeifImageDeleter> imageGuard(image);
+    if (importContext && importContext->isCanceled())
+        return false;
+    if (error.code != heif_error_Ok) {
+        qCWarning(heic, "Could not decode image %d: %s", index, error.message);
+        return false;
+    }
+
+    int bytesPerLine = 0;
+    const uint8_t *data = heif_image_get_plane_readonly(image, heif_channel_interleaved, &bytesPerLine);
+    if (!data)
+        return false;
+
+    // libheif can't decode into a caller's buffer, so a frame provided by the context,
+    // e.g. in shared memory, gets a single copy of the output plane, which is freed
+    // right away. Otherwise the frame adopts the output plane and no copy is made.
+    // libheif aligns rows to at least 16 bytes, which satisfies QImage.
+    QImage frame = importContext ? importContext->allocateFrame(QSize(width, height), QImage::Format_RGB888) : QImage();
+    if (!frame.isNull()) {
+        for (int y = 0; y < height; ++y)
+            std::memcpy(frame.scanLine(y), data + qint64(y) * bytesPerLine, size_t(width) * 3);
+        imageGuard.reset();
+    } else {
+        frame = QImage(data, width, height, bytesPerLine, QImage::Format_RGB888, releaseHeifImage, imageGuard.take());
+    }
+
+    const qint64 frameBytes = qint64(frame.bytesPerLine()) * height;
+    reservation.release(workingBytes - frameBytes);
+
+    if (importContext)
+        importContext->frameDecoded(index, frames->count(), frame);
+
+    frames->insert(index, std::move(frame));
+    reservation.transfer(frameBytes);
+
+    scope.addFrames(1);
+
+    return true;
+}
+
+static QImage decodeThumbnail(heif_context *context, heif_item_id id, int index)
 {
-    QVector<Wallpaper::Image> images;
+    ProfileScope scope(Profiler::Decode, index);
+
+    heif_image_handle *handle = nullptr;
+    if (heif_context_get_image_handle(context, id, &handle).code != heif_error_Ok)
+        return QImage();
+    QScopedPointer<heif_image_handle, HeifImageHandleDeleter> handleGuard(handle);
+
+    const int thumbnailCount = heif_image_handle_get_number_of_thumbnails(handle);
+    if (!thumbnailCount)
+        return QImage();
+
+    QVector<heif_item_id> thumbnailIds(thumbnailCount);
+    heif_image_handle_get_list_of_thumbnail_IDs(handle, thumbnailIds.data(), thumbnailCount);
+
+    // Pick the largest thumbnail, it's still tiny compared to the full image.
+    QScopedPointer<heif_image_handle, HeifImageHandleDeleter> thumbnailHandle;
+    for (const heif_item_id &thumbnailId : thumbnailIds) {
+        heif_image_handle *candidate = nullptr;
+        if (heif_image_handle_get_thumbnail(handle, thumbnailId, &candidate).code != heif_error_Ok)
+            continue;
+        if (!thumbnailHandle || heif_image_handle_get_width(candidate) > heif_image_handle_get_width(thumbnailHandle.data()))
+            thumbnailHandle.reset(candidate);
+        else
+            heif_image_handle_release(candidate);
+    }
+    if (!thumbnailHandle)
+        return QImage();
+
+    heif_image *image = nullptr;
+    heif_error error = heif_decode_image(thumbnailHandle.data(), &image, heif_colorspace_RGB, heif_chroma_interleaved_24bit, nullptr);
+    QScopedPointer<heif_image, HeifImageDeleter> imageGuard(image);
+    if (error.code != heif_error_Ok)
+        return QImage();
+
+    int bytesPerLine = 0;
+    const uint8_t *data = heif_image_get_plane_readonly(image, heif_channel_interleaved, &bytesPerLine);
+    if (!data)
+        return QImage();
+
+    const int width = heif_image_get_width(image, heif_channel_interleaved);
+    const int height = heif_image_get_height(image, heif_channel_interleaved);
+
+    // The thumbnail is copied to a pooled buffer, which charges it to the memory budget.
+    QImage thumbnail = BufferPool::self()->createImage(QSize(width, height), QImage::Format_RGB888);
+    if (thumbnail.isNull())
+        return QImage();
+    for (int y = 0; y < height; ++y)
+        std::memcpy(thumbnail.scanLine(y), data + qint64(y) * bytesPerLine, size_t(width) * 3);
+
+    return thumbnail;
+}
 
+static QVector<heif_item_id> discoverImageIds(heif_context *context)
+{
     const int imageCount = heif_context_get_number_of_top_level_images(context);
     QVector<heif_item_id> imageIds(imageCount);
     heif_context_get_list_of_top_level_image_IDs(context, imageIds.data(), imageCount);
+    return imageIds;
+}
 
-    for (const heif_item_id &id : imageIds) {
-        heif_image_handle *handle = nullptr;
-        heif_error error = heif_context_get_image_handle(context, id, &handle);
-        if (error.code != heif_error_Ok)
-            continue;
+#if defined(HAVE_HEIF_IMAGE_TILING)
+static std::unique_ptr<BandReader> openImageBands(std::shared_ptr<heif_context> context, heif_item_id id, int index, ImportContext *importContext)
+{
+    heif_image_handle *handle = nullptr;
+    if (heif_context_get_image_handle(context.get(), id, &handle).code != heif_error_Ok)
+        return nullptr;
+    QScopedPointer<heif_image_handle, HeifImageHandleDeleter> handleGuard(handle);
 
-        heif_image *image = nullptr;
-        error = heif_decode_image(handle, &image, heif_colorspace_RGB, heif_chroma_interleaved_24bit, nullptr);
-        if (error.code != heif_error_Ok)
-            continue;
+    heif_image_tiling tiling;
+    if (heif_image_handle_get_image_tiling(handle, 1, &tiling).code != heif_error_Ok)
+        return nullptr;
 
-        int bytesPerLine = 0;
-        const uint8_t *data = heif_image_get_plane_readonly(image, heif_channel_interleaved, &bytesPerLine);
-        if (!data)
-            continue;
+    // An image that consists of a single row of tiles gains nothing from bands.
+    if (tiling.num_rows < 2)
+        return nullptr;
+
+    auto reader = std::make_unique<HeifBandReader>(context, handleGuard.take(), tiling, index, importContext);
+    if (!reader->isValid())
+        return nullptr;
 
-        const int width = heif_image_handle_get_width(handle);
-        const int height = heif_image_handle_get_height(handle);
+    return reader;
+}
+#endif
+
+static std::shared_ptr<FrameStore> discoverImages(std::shared_ptr<heif_context> context, ImportContext *importContext, QVector<int> *undecodedIndices)
+{
+    const QVector<heif_item_id> imageIds = discoverImageIds(context.get());
+
+    auto frames = std::make_shared<FrameStore>(imageIds.count());
+
+    // If decoding is deferred, the frame store keeps the source file open and decodes
+    // frames the first time they are pinned. That happens in tasks of the concurrency
+    // governor, which already occupy all of its threads, so libheif must not spawn
+    // threads of its own either.
+    if (importContext && importContext->deferredDecoding()) {
+#if defined(HAVE_HEIF_MAX_DECODING_THREADS)
+        heif_context_set_max_decoding_threads(context.get(), 1);
+#endif
+        FrameStore *store = frames.get();
+        frames->setLoader([context, imageIds, store, importContext](int index) {
+            return decodeImage(context.get(), imageIds.at(index), index, store, importContext);
+        });
+#if defined(HAVE_HEIF_IMAGE_TILING)
+        frames->setBandLoader([context, imageIds, importContext](int index) {
+            return openImageBands(context, imageIds.at(index), index, importContext);
+        });
+#endif
+        return frames;
+    }
 
-        Wallpaper::Image wallpaperImage;
-        wallpaperImage.data = QImage(data, width, height, bytesPerLine, QImage::Format_RGB888).copy();
-        images << wallpaperImage;
+    // Frames are decoded concurrently, each on the NUMA node that will encode it. If the
+    // memory budget is tight, decodes are throttled by MemoryBudget::acquire() and
+    // decoded frames get spilled to the disk. Since frames are the unit of parallelism,
+    // libheif is asked not to spawn threads of its own.
+#if defined(HAVE_HEIF_MAX_DECODING_THREADS)
+    heif_context_set_max_decoding_threads(context.get(), 1);
+#endif
+
+    std::vector<char> decoded(imageIds.count());
+    ConcurrencyGovernor::self()->map(imageIds.count(), [&](int index) {
+        decoded[index] = decodeImage(context.get(), imageIds.at(index), index, frames.get(), importContext);
+    });
+
+    for (int i = 0; i < imageIds.count(); ++i) {
+        if (!decoded[i])
+            undecodedIndices->append(i);
     }
 
-    return images;
+    return frames;
 }
 
 static QByteArray discoverMetaData(heif_context *context)
@@ -125,9 +499,12 @@ static Wallpaper::Type wallpaperTypeFromMetaData(const QByteArray &metaData)
         { QByteArrayLiteral("ti"), Wallpaper::Timed },
     };
 
-    plist_t plist;
+    plist_t plist = nullptr;
     plist_from_memory(metaData.data(), metaData.size(), &plist);
 
+    if (!plist)
+        return type;
+
     for (const QPair<QByteArray, Wallpaper::Type> &pair : types) {
         if (!plist_dict_get_item(plist, pair.first))
             continue;
@@ -140,25 +517,36 @@ static Wallpaper::Type wallpaperTypeFromMetaData(const QByteArray &metaData)
     return type;
 }
 
-static bool associateSolarMetaData(const QByteArray &metaData, QVector<Wallpaper::Image> &images)
+static bool associateSolarMetaData(const QByteArray &metaData, std::vector<Wallpaper::Image> &images)
 {
-    plist_t plist;
+    plist_t plist = nullptr;
     plist_from_memory(metaData.data(), metaData.size(), &plist);
 
-    plist_t root = plist_dict_get_item(plist, "si");
+    plist_t root = plist ? plist_dict_get_item(plist, "si") : nullptr;
+    if (!root || plist_get_node_type(root) != PLIST_ARRAY) {
+        qCWarning(heic, "Malformed solar metadata");
+        plist_free(plist);
+        return false;
+    }
 
     const int itemCount = plist_array_get_size(root);
     for (int i = 0; i < itemCount; ++i) {
         plist_t node = plist_array_get_item(root, i);
 
-        qreal azimuth;
-        qreal elevation;
-        uint64_t imageIndex;
+        qreal azimuth = 0;
+        qreal elevation = 0;
+        uint64_t imageIndex = std::numeric_limits<uint64_t>::max();
 
         plist_get_uint_val(plist_dict_get_item(node, "i"), &imageIndex);
         plist_get_real_val(plist_dict_get_item(node, "z"), &azimuth);
         plist_get_real_val(plist_dict_get_item(node, "a"), &elevation);
 
+        if (imageIndex >= images.size()) {
+            qCWarning(heic, "Solar metadata refers to non-existent image %llu", static_cast<unsigned long long>(imageIndex));
+            plist_free(plist);
+            return false;
+        }
+
         images[imageIndex].azimuth = azimuth;
         images[imageIndex].elevation = elevation;
     }
@@ -168,23 +556,34 @@ static bool associateSolarMetaData(const QByteArray &metaData, QVector<Wallpaper
     return true;
 }
 
-static bool associateTimedMetaData(const QByteArray &metaData, QVector<Wallpaper::Image> &images)
+static bool associateTimedMetaData(const QByteArray &metaData, std::vector<Wallpaper::Image> &images)
 {
-    plist_t plist;
+    plist_t plist = nullptr;
     plist_from_memory(metaData.data(), metaData.size(), &plist);
 
-    plist_t root = plist_dict_get_item(plist, "ti");
+    plist_t root = plist ? plist_dict_get_item(plist, "ti") : nullptr;
+    if (!root || plist_get_node_type(root) != PLIST_ARRAY) {
+        qCWarning(heic, "Malformed timed metadata");
+        plist_free(plist);
+        return false;
+    }
 
     const int itemCount = plist_array_get_size(root);
     for (int i = 0; i < itemCount; ++i) {
         plist_t node = plist_array_get_item(root, i);
 
-        qreal time;
-        uint64_t imageIndex;
+        qreal time = 0;
+        uint64_t imageIndex = std::numeric_limits<uint64_t>::max();
 
         plist_get_uint_val(plist_dict_get_item(node, "i"), &imageIndex);
         plist_get_real_val(plist_dict_get_item(node, "t"), &time);
 
+        if (imageIndex >= images.size()) {
+            qCWarning(heic, "Timed metadata refers to non-existent image %llu", static_cast<unsigned long long>(imageIndex));
+            plist_free(plist);
+            return false;
+        }
+
         images[imageIndex].time = time;
     }
 
@@ -209,36 +608,56 @@ static bool isHeifFile(const QString &fileName)
 }
 
 std::unique_ptr<Wallpaper> HeicImporter::load(const QString &fileName) const
+{
+    return load(fileName, nullptr);
+}
+
+std::unique_ptr<Wallpaper> HeicImporter::load(const QString &fileName, ImportContext *importContext) const
 {
     if (!isHeifFile(fileName))
         return nullptr;
 
-    QScopedPointer<heif_context, HeifContextDeleter> context(heif_context_alloc());
+    std::shared_ptr<heif_context> context(heif_context_alloc(), heif_context_free);
 
-    heif_error error = heif_context_read_from_file(context.data(), fileName.toUtf8(), nullptr);
-    if (error.code != heif_error_Ok) {
-        qCWarning(heic, "Could not load %s: %s", fileName.toUtf8().constData(), error.message);
-        return nullptr;
+    {
+        ProfileScope scope(Profiler::Read);
+        heif_error error = heif_context_read_from_file(context.get(), fileName.toUtf8(), nullptr);
+        if (error.code != heif_error_Ok) {
+            qCWarning(heic, "Could not load %s: %s", fileName.toUtf8().constData(), error.message);
+            return nullptr;
+        }
+        scope.addBytesRead(QFileInfo(fileName).size());
     }
 
-    const QByteArray metaData = discoverMetaData(context.data());
-    if (metaData.isEmpty()) {
-        qCWarning(heic, "Could not find wallpaper metadata");
-        return nullptr;
-    }
+    QByteArray metaData;
+    Wallpaper::Type type;
+    {
+        ProfileScope scope(Profiler::MetaData);
+        metaData = discoverMetaData(context.get());
+        if (metaData.isEmpty()) {
+            qCWarning(heic, "Could not find wallpaper metadata");
+            return nullptr;
+        }
 
-    const Wallpaper::Type type = wallpaperTypeFromMetaData(metaData);
-    if (type == Wallpaper::Type::Unknown) {
-        qCWarning(heic, "Unknown wallpaper type");
-        return nullptr;
+        type = wallpaperTypeFromMetaData(metaData);
+        if (type == Wallpaper::Type::Unknown) {
+            qCWarning(heic, "Unknown wallpaper type");
+            return nullptr;
+        }
     }
 
-    QVector<Wallpaper::Image> images = discoverImages(context.data());
-    if (images.isEmpty()) {
+    QVector<int> undecodedIndices;
+    std::shared_ptr<FrameStore> frames = discoverImages(context, importContext, &undecodedIndices);
+    if (importContext && importContext->isCanceled())
+        return nullptr;
+    if (frames->count() == undecodedIndices.count()) {
         qCWarning(heic, "Dynamic wallpaper does not have any images");
         return nullptr;
     }
 
+    std::vector<Wallpaper::Image> images(frames->count());
+
+    ProfileScope scope(Profiler::MetaData);
     switch (type) {
     case Wallpaper::Type::Solar:
         if (!associateSolarMetaData(metaData, images))
@@ -253,5 +672,22 @@ std::unique_ptr<Wallpaper> HeicImporter::load(const QString &fileName) const
         break;
     }
 
-    return std::make_unique<Wallpaper>(type, images);
+    // Images that cannot be decoded are skipped. The metadata refers to images by their
+    // position in the file, so they are removed only after it has been associated.
+    QVector<heif_item_id> imageIds = discoverImageIds(context.get());
+    for (int i = undecodedIndices.count() - 1; i >= 0; --i) {
+        const int index = undecodedIndices.at(i);
+        qCWarning(heic, "Skipping image %d, it cannot be decoded", index);
+        images.erase(images.begin() + index);
+        imageIds.remove(index);
+        frames->remove(index);
+    }
+
+    // Thumbnails are decoded only if the writer asks for them, i.e. for the preview.
+    auto wallpaper = std::make_unique<Wallpaper>(type, std::move(images), frames);
+    wallpaper->setThumbnailLoader([context, imageIds](int index) {
+        return decodeThumbnail(context.get(), imageIds.at(index), index);
+    });
+
+    return wallpaper;
 }
@@ -31,6 +31,7 @@ public:
     ~HeicImporter() override;
 
     std::unique_ptr<Wallpaper> load(const QString &fileName) const override;
+    std::unique_ptr<Wallpaper> load(const QString &fileName, ImportContext *context) const override;
 
 private:
     Q_DISABLE_COPY(HeicImporter)
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "PackageImporter.h"
+#include "FrameStore.h"
+#include "ImportContext.h"
+#include "MemoryBudget.h"
+#include "PackageArchive.h"
+#include "Profiler.h"
+#include "Wallpaper.h"
+
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QRegularExpression>
+
+#include <functional>
+#include <vector>
+
+Q_LOGGING_CATEGORY(package, "package")
+
+namespace {
+
+// Provides the entries of a package by their package-relative names.
+struct PackageReader
+{
+    std::function<QStringList()> entries;
+    std::function<bool(const QString &)> contains;
+    std::function<QByteArray(const QString &)> read;
+};
+
+} // namespace
+
+PackageImporter::PackageImporter(QObject *parent)
+    : Importer(parent)
+{
+}
+
+PackageImporter::~PackageImporter()
+{
+}
+
+static qint64 estimateImageSize(const QImageReader &reader)
+{
+    const QSize size = reader.size();
+
+    // If the reader can't tell the pixel format up front, assume the widest one.
+    int bitsPerPixel = 64;
+    if (reader.imageFormat() != QImage::Format_Invalid)
+        bitsPerPixel = QImage::toPixelFormat(reader.imageFormat()).bitsPerPixel();
+
+    const qint64 bytesPerLine = ((qint64(size.width()) * bitsPerPixel + 31) >> 5) << 2;
+    return bytesPerLine * size.height();
+}
+
+static bool decodeImage(const QByteArray &data, const QString &format, int index, FrameStore *frames, ImportContext *importContext)
+{
+    if (importContext && importContext->isCanceled())
+        return false;
+
+    ProfileScope scope(Profiler::Decode, index);
+
+    QBuffer buffer;
+    buffer.setData(data);
+    buffer.open(QIODevice::ReadOnly);
+
+    QImageReader reader(&buffer, format.toLatin1());
+    if (!reader.size().isValid()) {
+        qCWarning(package, "Could not read image %d: %s", index, qPrintable(reader.errorString()));
+        return false;
+    }
+
+    const qint64 estimatedBytes = estimateImageSize(reader);
+    MemoryReservation reservation(estimatedBytes);
+    if (!reservation.isValid()) {
+        qCWarning(package, "Image %d does not fit in the memory budget", index);
+        return false;
+    }
+
+    QImage image;
+    if (!reader.read(&image)) {
+        qCWarning(package, "Could not decode image %d: %s", index, qPrintable(reader.errorString()));
+        return false;
+    }
+
+    if (importContext)
+        importContext->frameDecoded(index, frames->count(), image);
+
+    // The estimate can be off if the decoder picks another pixel format, in which case
+    // the frame store charges the frame itself.
+    const qint64 bytes = qint64(image.bytesPerLine()) * image.height();
+    if (bytes > estimatedBytes) {
+        reservation.release(estimatedBytes);
+        frames->adopt(index, std::move(image));
+    } else {
+        reservation.release(estimatedBytes - bytes);
+        frames->insert(index, std::move(image));
+        reservation.transfer(bytes);
+    }
+
+    scope.addFrames(1);
+
+    return true;
+}
+
+static PackageReader openPackage(const QString &fileName)
+{
+    const QFileInfo fileInfo(fileName);
+
+    if (fileInfo.isDir() || fileInfo.fileName() == QLatin1String("metadata.json")) {
+        const QDir root = fileInfo.isDir() ? QDir(fileName) : fileInfo.dir();
+        if (!root.exists(QStringLiteral("metadata.json")))
+            return PackageReader();
+
+        // Files are read only when they are needed, e.g. when an image is written or
+        // decoded, so they don't sit in memory next to the decoded frames.
+        PackageReader reader;
+        reader.entries = [root]() {
+            QStringList entries;
+            const QDir imageDirectory(root.filePath(QStringLiteral("contents/images")));
+            for (const QString &imageFileName : imageDirectory.entryList(QDir::Files))
+                entries.append(QLatin1String("contents/images/") + imageFileName);
+            return entries;
+        };
+        reader.contains = [root](const QString &name) {
+            return QFileInfo(root.filePath(name)).isFile();
+        };
+        reader.read = [root](const QString &name) {
+            QFile file(root.filePath(name));
+            if (!file.open(QIODevice::ReadOnly))
+                return QByteArray();
+            return file.readAll();
+        };
+        return reader;
+    }
+
+    if (fileInfo.suffix() == QLatin1String("dwpack")) {
+        // Entries refer to the mapped file, which stays mapped as long as a copy of the
+        // reader is alive.
+        auto archive = std::make_shared<PackageArchive>(fileName);
+        if (!archive->open()) {
+            qCWarning(package, "%s is not a valid packed package", qPrintable(fileName));
+            return PackageReader();
+        }
+
+        PackageReader reader;
+        reader.entries = [archive]() {
+            return archive->entries();
+        };
+        reader.contains = [archive](const QString &name) {
+            return archive->contains(name);
+        };
+        reader.read = [archive](const QString &name) {
+            return archive->entry(name);
+        };
+        return reader;
+    }
+
+    return PackageReader();
+}
+
+static bool isValidImageFileName(const QString &fileName)
+{
+    // File names come from the package, they must not point outside of contents/images.
+    return !fileName.isEmpty()
+        && !fileName.contains(QLatin1Char('/'))
+        && !fileName.contains(QLatin1Char('\\'))
+        && fileName != QLatin1String(".")
+        && fileName != QLatin1String("..");
+}
+
+static QByteArray readImage(const PackageReader &reader, const QString &name)
+{
+    ProfileScope scope(Profiler::Read);
+
+    const QByteArray encodedData = reader.read(name);
+    if (encodedData.isEmpty())
+        qCWarning(package, "Could not read %s", qPrintable(name));
+    scope.addBytesRead(encodedData.size());
+
+    return encodedData;
+}
+
+static Wallpaper::Type wallpaperTypeFromString(const QString &type)
+{
+    if (type == QLatin1String("solar"))
+        return Wallpaper::Solar;
+    if (type == QLatin1String("timed"))
+        return Wallpaper::Timed;
+    return Wallpaper::Unknown;
+}
+
+std::unique_ptr<Wallpaper> PackageImporter::load(const QString &fileName) const
+{
+    return load(fileName, nullptr);
+}
+
+std::unique_ptr<Wallpaper> PackageImporter::load(const QString &fileName, ImportContext *importContext) const
+{
+    const PackageReader reader = openPackage(fileName);
+    if (!reader.read)
+        return nullptr;
+    if (importContext && importContext->isCanceled())
+        return nullptr;
+
+    QJsonArray metaDataArray;
+    Wallpaper::Type type;
+    {
+        ProfileScope scope(Profiler::MetaData);
+        const QByteArray metaData = reader.read(QStringLiteral("metadata.json"));
+        const QJsonObject wallpaperObject = QJsonDocument::fromJson(metaData).object().value(QLatin1String("Wallpaper")).toObject();
+
+        type = wallpaperTypeFromString(wallpaperObject.value(QLatin1String("Type")).toString());
+        if (type == Wallpaper::Unknown) {
+            qCWarning(package, "Unknown wallpaper type");
+            return nullptr;
+        }
+
+        metaDataArray = wallpaperObject.value(QLatin1String("MetaData")).toArray();
+        if (metaDataArray.isEmpty()) {
+            qCWarning(package, "Dynamic wallpaper does not have any images");
+            return nullptr;
+        }
+    }
+
+    std::vector<Wallpaper::Image> images(metaDataArray.count());
+    QStringList imageEntries;
+    QStringList encodedFormats;
+    for (int i = 0; i < metaDataArray.count(); ++i) {
+        const QJsonObject imageObject = metaDataArray.at(i).toObject();
+        const QString imageFileName = imageObject.value(QLatin1String("FileName")).toString();
+        if (!isValidImageFileName(imageFileName)) {
+            qCWarning(package, "Invalid image file name %s", qPrintable(imageFileName));
+            return nullptr;
+        }
+
+        const QString imageEntry = QLatin1String("contents/images/") + imageFileName;
+        if (!reader.contains(imageEntry)) {
+            qCWarning(package, "Could not find %s", qPrintable(imageFileName));
+            return nullptr;
+        }
+
+        Wallpaper::Image &image = images[i];
+        image.azimuth = imageObject.value(QLatin1String("Azimuth")).toDouble();
+        image.elevation = imageObject.value(QLatin1String("Elevation")).toDouble();
+        image.time = imageObject.value(QLatin1String("Time")).toDouble();
+        image.encodedFormat = QFileInfo(imageFileName).suffix();
+
+        imageEntries.append(imageEntry);
+        encodedFormats.append(image.encodedFormat);
+    }
+
+    // Frames are decoded only if they have to be converted to another format or are
+    // needed for the preview; frames written in the same format are copied as is.
+    //
+    // The encoded data of a packed package refers to the mapped file. The loaders keep
+    // the reader, and with it the mapping, alive as long as the wallpaper. Decoded
+    // frames are reported to the context only if the caller has asked for deferred
+    // decoding, since it promises to keep the context alive then.
+    if (importContext && !importContext->deferredDecoding())
+        importContext = nullptr;
+    auto frames = std::make_shared<FrameStore>(metaDataArray.count());
+    FrameStore *store = frames.get();
+    frames->setLoader([reader, imageEntries, encodedFormats, store, importContext](int index) {
+        const QByteArray encodedData = readImage(reader, imageEntries.at(index));
+        if (encodedData.isEmpty())
+            return false;
+        return decodeImage(encodedData, encodedFormats.at(index), index, store, importContext);
+    });
+
+    auto wallpaper = std::make_unique<Wallpaper>(type, std::move(images), frames);
+    wallpaper->setEncodedDataLoader([reader, imageEntries](int index) {
+        return readImage(reader, imageEntries.at(index));
+    });
+
+    // A preview of the requested size is written as is, so its size is read up front.
+    const QStringList previewEntries = reader.entries().filter(QRegularExpression(QStringLiteral("^contents/images/preview\\.[^/.]+$")));
+    if (!previewEntries.isEmpty()) {
+        const QString previewEntry = previewEntries.first();
+        const QByteArray encodedPreview = reader.read(previewEntry);
+        const QString previewFormat = QFileInfo(previewEntry).suffix();
+        QBuffer buffer;
+        buffer.setData(encodedPreview);
+        buffer.open(QIODevice::ReadOnly);
+        const QSize previewSize = QImageReader(&buffer, previewFormat.toLatin1()).size();
+        if (previewSize.isValid()) {
+            wallpaper->setEncodedPreview(previewSize, previewFormat, [reader, previewEntry]() {
+                return reader.read(previewEntry);
+            });
+        }
+    }
+
+    return wallpaper;
+}
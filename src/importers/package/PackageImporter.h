@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2019 Vlad Zahorodnii <vladzzag@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "Importer.h"
+
+/**
+ * The PackageImporter class loads wallpaper packages that have been written by Writer,
+ * either as a directory with a metadata.json file or as a packed file.
+ *
+ * Images are kept encoded and read only when they're written; they're decoded only if
+ * they need to be converted to another format or are used to build the preview. The
+ * preview of the package is offered as is, see Wallpaper::encodedPreview().
+ */
+class Q_DECL_EXPORT PackageImporter : public Importer
+{
+    Q_OBJECT
+    Q_PLUGIN_METADATA(IID "com.github.zzag.wallpaper.Importer")
+    Q_INTERFACES(Importer)
+
+public:
+    explicit PackageImporter(QObject *parent = nullptr);
+    ~PackageImporter() override;
+
+    std::unique_ptr<Wallpaper> load(const QString &fileName) const override;
+    std::unique_ptr<Wallpaper> load(const QString &fileName, ImportContext *context) const override;
+
+private:
+    Q_DISABLE_COPY(PackageImporter)
+};
@@ -16,18 +16,109 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-#include <QGuiApplication>
+#include <QCoreApplication>
 
 #include <QCommandLineOption>
 #include <QCommandLineParser>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QFutureSynchronizer>
+#include <QHash>
+#include <QThreadPool>
+#include <QtConcurrent>
 
+#include <algorithm>
+#include <atomic>
+
+#include "ConcurrencyGovernor.h"
+#include "ContentStore.h"
+#include "DecodeWorkerPool.h"
+#include "ImportContext.h"
 #include "Loader.h"
+#include "MemoryBudget.h"
+#include "Profiler.h"
 #include "Wallpaper.h"
 #include "Writer.h"
 
+#ifdef STATIC_IMPORTERS
+#include <QtPlugin>
+
+Q_IMPORT_PLUGIN(HeicImporter)
+Q_IMPORT_PLUGIN(PackageImporter)
+#endif
+
+static qint64 parseSize(const QString &text, bool *ok)
+{
+    static const QString suffixes = QStringLiteral("KMGT");
+
+    QString number = text.trimmed();
+    qint64 multiplier = 1;
+
+    const int suffixIndex = number.isEmpty() ? -1 : suffixes.indexOf(number.at(number.size() - 1).toUpper());
+    if (suffixIndex != -1) {
+        multiplier <<= 10 * (suffixIndex + 1);
+        number.chop(1);
+    }
+
+    const qint64 value = number.toLongLong(ok);
+    return value * multiplier;
+}
+
+static Writer::Parts parseParts(const QString &text, bool *ok)
+{
+    Writer::Parts parts;
+    *ok = true;
+
+    const QStringList names = text.split(QLatin1Char(','), QString::SkipEmptyParts);
+    for (const QString &name : names) {
+        if (name == QLatin1String("images"))
+            parts |= Writer::Images;
+        else if (name == QLatin1String("preview"))
+            parts |= Writer::Preview;
+        else if (name == QLatin1String("metadata"))
+            parts |= Writer::MetaData;
+        else
+            *ok = false;
+    }
+
+    return parts;
+}
+
+static Writer::Output parseOutput(const QString &text, bool *ok)
+{
+    Writer::Output output;
+    *ok = false;
+
+    // The format specification comes first, so the directory may contain colons.
+    const int separatorIndex = text.indexOf(QLatin1Char(':'));
+    if (separatorIndex == -1)
+        return output;
+
+    const QStringList specification = text.left(separatorIndex).split(QLatin1Char(','));
+    output.format = specification.first();
+    output.targetPath = text.mid(separatorIndex + 1);
+    if (output.format.isEmpty() || output.targetPath.isEmpty())
+        return output;
+
+    for (int i = 1; i < specification.count(); ++i) {
+        const QString &parameter = specification.at(i);
+        if (!parameter.startsWith(QLatin1String("q=")))
+            return output;
+        bool qualityOk = false;
+        output.quality = parameter.mid(2).toInt(&qualityOk);
+        if (!qualityOk || output.quality < 0 || output.quality > 100)
+            return output;
+    }
+
+    *ok = true;
+    return output;
+}
+
 int main(int argc, char **argv)
 {
-    QGuiApplication app(argc, argv);
+    // The tool never shows a window, so it needn't connect to a display server.
+    QCoreApplication app(argc, argv);
     QCoreApplication::setApplicationName("dynamic-wallpaper-importer");
     QCoreApplication::setApplicationVersion("1.0");
 
@@ -38,12 +129,12 @@ int main(int argc, char **argv)
 
     QCommandLineOption formatOption(QStringLiteral("format"),
         QCoreApplication::translate("format", "Preferred image format."),
-        QCoreApplication::translate("format", "png|jpg"),
+        QCoreApplication::translate("format", "png|jpg|auto"),
         QStringLiteral("png"));
     parser.addOption(formatOption);
 
     QCommandLineOption sourceOption(QStringLiteral("source"),
-        QCoreApplication::translate("main", "Path to the source dynamic wallpaper."),
+        QCoreApplication::translate("main", "Path to the source dynamic wallpaper. Can be given several times."),
         QCoreApplication::translate("main", "file"));
     parser.addOption(sourceOption);
 
@@ -62,22 +153,300 @@ int main(int argc, char **argv)
         QCoreApplication::translate("target", "directory"));
     parser.addOption(targetOption);
 
+    QCommandLineOption outputOption(QStringLiteral("output"),
+        QCoreApplication::translate("main", "Write a package in the given format, optionally with the given quality, to the given directory. Can be given several times."),
+        QCoreApplication::translate("main", "format[,q=quality]:directory"));
+    parser.addOption(outputOption);
+
+    QCommandLineOption previewSizeOption(QStringLiteral("preview-size"),
+        QCoreApplication::translate("main", "Size of the preview image."),
+        QCoreApplication::translate("main", "widthxheight"));
+    parser.addOption(previewSizeOption);
+
+    QCommandLineOption partsOption(QStringLiteral("parts"),
+        QCoreApplication::translate("main", "Parts of the wallpaper package to write."),
+        QCoreApplication::translate("main", "images,preview,metadata"),
+        QStringLiteral("images,preview,metadata"));
+    parser.addOption(partsOption);
+
+    QCommandLineOption packedOption(QStringLiteral("packed"),
+        QCoreApplication::translate("main", "Write the package as a single packed file rather than a directory."));
+    parser.addOption(packedOption);
+
+    QCommandLineOption bandStreamingOption(QStringLiteral("band-streaming"),
+        QCoreApplication::translate("main", "Decode, convert and encode images in horizontal bands to bound memory use."));
+    parser.addOption(bandStreamingOption);
+
+    QCommandLineOption storeOption(QStringLiteral("store"),
+        QCoreApplication::translate("main", "Share encoded images through the given content-addressed store."),
+        QCoreApplication::translate("main", "directory"));
+    parser.addOption(storeOption);
+
+    QCommandLineOption collectGarbageOption(QStringLiteral("collect-garbage"),
+        QCoreApplication::translate("main", "Remove images that are no longer used by any package from the store."));
+    parser.addOption(collectGarbageOption);
+
+    QCommandLineOption maxMemoryOption(QStringLiteral("max-memory"),
+        QCoreApplication::translate("main", "Maximum amount of memory for decoded images, e.g. 512M or 2G, or auto for three quarters of the cgroup memory limit."),
+        QCoreApplication::translate("main", "size"));
+    parser.addOption(maxMemoryOption);
+
+    QCommandLineOption workersOption(QStringLiteral("workers"),
+        QCoreApplication::translate("main", "Decode in the given number of isolated worker processes."),
+        QCoreApplication::translate("main", "count"));
+    parser.addOption(workersOption);
+
+    QCommandLineOption workerTimeoutOption(QStringLiteral("worker-timeout"),
+        QCoreApplication::translate("main", "Restart decode workers that take longer than the given number of seconds per file."),
+        QCoreApplication::translate("main", "seconds"));
+    parser.addOption(workerTimeoutOption);
+
+    QCommandLineOption decodeWorkerOption(QStringLiteral("decode-worker"),
+        QCoreApplication::translate("main", "Serve decode requests on the given socket."),
+        QCoreApplication::translate("main", "socket"));
+    decodeWorkerOption.setFlags(QCommandLineOption::HiddenFromHelp);
+    parser.addOption(decodeWorkerOption);
+
+    QCommandLineOption traceOption(QStringLiteral("trace"),
+        QCoreApplication::translate("main", "Write Chrome trace events of the import to the given file."),
+        QCoreApplication::translate("main", "file"));
+    parser.addOption(traceOption);
+
+    QCommandLineOption statsOption(QStringLiteral("stats"),
+        QCoreApplication::translate("main", "Print per-stage import statistics."));
+    parser.addOption(statsOption);
+
     parser.process(app);
 
-    if (!parser.isSet(sourceOption) || !parser.isSet(idOption) || !parser.isSet(labelOption))
+    // Decode workers get their share of the budget passed on the command line.
+    if (parser.value(maxMemoryOption) == QLatin1String("auto")) {
+        // Leave some room for the code, libheif and the encoders within the cgroup.
+        if (const qint64 memoryLimit = ConcurrencyGovernor::self()->memoryLimit())
+            MemoryBudget::self()->setLimit(memoryLimit / 4 * 3);
+        else
+            qWarning() << "The process has no cgroup memory limit, the memory budget is unlimited";
+    } else if (parser.isSet(maxMemoryOption)) {
+        bool ok = false;
+        const qint64 maxMemory = parseSize(parser.value(maxMemoryOption), &ok);
+        if (!ok || maxMemory <= 0)
+            parser.showHelp(-1);
+        MemoryBudget::self()->setLimit(maxMemory);
+    }
+
+    if (parser.isSet(decodeWorkerOption)) {
+        bool ok = false;
+        const int socket = parser.value(decodeWorkerOption).toInt(&ok);
+        if (!ok)
+            return -1;
+
+        // Every worker reports its own decodes when the pool goes away. Its trace is
+        // written next to the one of the pool, named after the process id.
+        const QString pid = QString::number(QCoreApplication::applicationPid());
+        Profiler::self()->setTraceEnabled(parser.isSet(traceOption));
+        Profiler::self()->setStatisticsEnabled(parser.isSet(statsOption));
+
+        Loader loader;
+        const int status = DecodeWorkerPool::serve(socket, &loader);
+
+        if (parser.isSet(statsOption))
+            Profiler::self()->printStatistics(QStringLiteral("decode worker ") + pid);
+        if (parser.isSet(traceOption) && !Profiler::self()->writeTrace(parser.value(traceOption) + QLatin1Char('.') + pid)) {
+            qWarning() << "Could not write the trace of decode worker" << pid;
+            return -1;
+        }
+
+        return status;
+    }
+
+    std::shared_ptr<ContentStore> contentStore;
+    if (parser.isSet(storeOption))
+        contentStore = std::make_shared<ContentStore>(parser.value(storeOption));
+
+    if (parser.isSet(collectGarbageOption)) {
+        if (!contentStore)
+            parser.showHelp(-1);
+        if (!parser.isSet(sourceOption)) {
+            contentStore->collectGarbage();
+            return 0;
+        }
+    }
+
+    // A single wallpaper gets the given id and label, a batch is named after its sources.
+    const QStringList sources = parser.values(sourceOption);
+    if (sources.isEmpty())
+        parser.showHelp(-1);
+    if (sources.count() == 1 && (!parser.isSet(idOption) || !parser.isSet(labelOption)))
         parser.showHelp(-1);
 
-    Loader loader;
-    std::shared_ptr<Wallpaper> wallpaper = loader.load(parser.value(sourceOption));
-    if (!wallpaper)
-        return -1;
+    // Packages of a batch are named after their sources, which must not overwrite each
+    // other, e.g. a/sunset.heic and b/sunset.heic.
+    if (sources.count() > 1) {
+        QHash<QString, QString> sourcesByName;
+        for (const QString &source : sources) {
+            const QString baseName = QFileInfo(source).completeBaseName();
+            const auto it = sourcesByName.constFind(baseName);
+            if (it != sourcesByName.constEnd()) {
+                qWarning() << *it << "and" << source << "would both be written as" << baseName;
+                return -1;
+            }
+            sourcesByName.insert(baseName, source);
+        }
+    }
+
+    int workerCount = 0;
+    if (parser.isSet(workersOption)) {
+        bool ok = false;
+        workerCount = parser.value(workersOption).toInt(&ok);
+        if (!ok || workerCount <= 0)
+            parser.showHelp(-1);
+    }
+
+    int workerTimeout = -1;
+    if (parser.isSet(workerTimeoutOption)) {
+        bool ok = false;
+        workerTimeout = parser.value(workerTimeoutOption).toInt(&ok);
+        if (!ok || workerTimeout <= 0 || !workerCount)
+            parser.showHelp(-1);
+    }
+
+    Profiler::self()->setTraceEnabled(parser.isSet(traceOption));
+    Profiler::self()->setStatisticsEnabled(parser.isSet(statsOption));
 
-    Writer writer;
-    writer.setWallpaper(wallpaper);
-    writer.setFormat(parser.value(formatOption));
-    writer.setId(parser.value(idOption));
-    writer.setName(parser.value(labelOption));
-    writer.write(parser.value(targetOption));
+    bool partsOk = false;
+    const Writer::Parts parts = parseParts(parser.value(partsOption), &partsOk);
+    if (!partsOk)
+        parser.showHelp(-1);
+
+    // Every output is a separate package written from the same decoded images.
+    QVector<Writer::Output> outputs;
+    if (parser.isSet(outputOption)) {
+        if (parser.isSet(formatOption) || parser.isSet(targetOption))
+            parser.showHelp(-1);
+
+        QStringList targetPaths;
+        for (const QString &value : parser.values(outputOption)) {
+            bool ok = false;
+            const Writer::Output output = parseOutput(value, &ok);
+            if (!ok)
+                parser.showHelp(-1);
+            const QString targetPath = QDir(output.targetPath).absolutePath();
+            if (targetPaths.contains(targetPath))
+                parser.showHelp(-1);
+            targetPaths.append(targetPath);
+            outputs.append(output);
+        }
+    }
+
+    QSize previewSize;
+    if (parser.isSet(previewSizeOption)) {
+        const QStringList dimensions = parser.value(previewSizeOption).split(QLatin1Char('x'));
+        if (dimensions.count() == 2)
+            previewSize = QSize(dimensions.at(0).toInt(), dimensions.at(1).toInt());
+        if (!previewSize.isValid() || previewSize.isEmpty())
+            parser.showHelp(-1);
+    }
+
+    std::unique_ptr<DecodeWorkerPool> workerPool;
+    std::unique_ptr<Loader> loader;
+    if (workerCount) {
+        // Every worker decodes a single file, while this process holds the frames of as
+        // many files, so the budget is split evenly between this process and the workers.
+        QStringList arguments;
+        if (const qint64 memoryLimit = MemoryBudget::self()->limit()) {
+            const qint64 workerLimit = std::max<qint64>(memoryLimit / 2 / workerCount, 1);
+            MemoryBudget::self()->setLimit(memoryLimit - workerLimit * workerCount);
+            arguments << QStringLiteral("--max-memory") << QString::number(workerLimit);
+        }
+        if (parser.isSet(traceOption))
+            arguments << QStringLiteral("--trace") << QFileInfo(parser.value(traceOption)).absoluteFilePath();
+        if (parser.isSet(statsOption))
+            arguments << QStringLiteral("--stats");
+        arguments << QStringLiteral("--decode-worker");
+
+        workerPool = std::make_unique<DecodeWorkerPool>(QCoreApplication::applicationFilePath(), arguments, workerCount);
+        if (!workerPool->count()) {
+            qWarning() << "Could not spawn any decode workers";
+            return -1;
+        }
+        if (workerTimeout > 0)
+            workerPool->setTimeout(workerTimeout * 1000);
+    } else {
+        loader = std::make_unique<Loader>();
+    }
+
+    Profiler::self()->recordStartup();
+
+    const auto importFile = [&](const QString &source) {
+        // Deferred frames are decoded while the wallpaper is written, so the context
+        // outlives it.
+        ImportContext context;
+        std::shared_ptr<Wallpaper> wallpaper;
+        if (workerPool) {
+            wallpaper = workerPool->load(source);
+        } else {
+            // If images are not written, they are decoded only if the preview needs them.
+            // Band streaming decodes images while they are being encoded.
+            context.setDeferredDecoding(!(parts & Writer::Images) || parser.isSet(bandStreamingOption));
+            wallpaper = loader->load(source, &context);
+        }
+        if (!wallpaper) {
+            qWarning() << "Could not import" << source;
+            return false;
+        }
+
+        const QString baseName = QFileInfo(source).completeBaseName();
+
+        Writer writer;
+        writer.setWallpaper(wallpaper);
+        writer.setFormat(parser.value(formatOption));
+        writer.setOutputs(outputs);
+        writer.setId(sources.count() == 1 ? parser.value(idOption) : baseName);
+        writer.setName(sources.count() == 1 ? parser.value(labelOption) : baseName);
+        writer.setContentStore(contentStore);
+        writer.setParts(parts);
+        writer.setPreviewSize(previewSize);
+        writer.setPacked(parser.isSet(packedOption));
+        writer.setBandStreaming(parser.isSet(bandStreamingOption));
+        writer.setReleaseImages(true);
+        if (!writer.write(parser.value(targetOption))) {
+            qWarning() << "Could not write" << source;
+            return false;
+        }
+
+        return true;
+    };
+
+    std::atomic<int> failureCount { 0 };
+    if (workerPool) {
+        // Every worker decodes one file at a time, so as many files are in flight as
+        // there are workers.
+        QThreadPool batchPool;
+        batchPool.setMaxThreadCount(workerPool->count());
+
+        QFutureSynchronizer<void> synchronizer;
+        for (const QString &source : sources) {
+            synchronizer.addFuture(QtConcurrent::run(&batchPool, [&, source]() {
+                if (!importFile(source))
+                    ++failureCount;
+            }));
+        }
+        synchronizer.waitForFinished();
+    } else {
+        for (const QString &source : sources) {
+            if (!importFile(source))
+                ++failureCount;
+        }
+    }
+
+    if (contentStore && parser.isSet(collectGarbageOption))
+        contentStore->collectGarbage();
+
+    if (parser.isSet(statsOption))
+        Profiler::self()->printStatistics();
+    if (parser.isSet(traceOption) && !Profiler::self()->writeTrace(parser.value(traceOption))) {
+        qWarning() << "Could not write the trace to" << parser.value(traceOption);
+        return -1;
+    }
 
-    return 0;
+    return failureCount ? -1 : 0;
 }